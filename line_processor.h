@@ -0,0 +1,59 @@
+/**
+ * @file line_processor.h
+ * @author Nils Streedain (https://github.com/nilsstreedain)
+ * @brief The zero-copy span interface of the line processor, for embedding its transforms in other programs.
+ *
+ * Input is submitted as spans of memory the caller keeps alive until they are acknowledged, and output is handed to the
+ * caller as spans of the pipeline's staging memory, which the caller releases once it has written them. Input bytes
+ * are read in place and every output byte is written once, straight into staging, so no data is copied on the way.
+ *
+ * Compile main.c with -DLINE_PROCESSOR_LIBRARY to leave out its main function and link it into another program.
+ */
+#ifndef LINE_PROCESSOR_H
+#define LINE_PROCESSOR_H
+
+#include <stddef.h>
+
+/**
+ * @struct SpanInput
+ * @brief A structure describing a span of input owned by the caller.
+ *
+ * The caller fills in data and len and must keep both the structure and the bytes alive until the span is passed to
+ * the acknowledge callback.
+ *
+ * @var SpanInput::data
+ * A pointer to the input bytes.
+ * @var SpanInput::len
+ * The number of input bytes.
+ * @var SpanInput::done
+ * The number of bytes already transformed, maintained by the pipeline.
+ * @var SpanInput::next
+ * A pointer to the next queued span, maintained by the pipeline.
+ */
+typedef struct SpanInput {
+	const char* data;
+	size_t len;
+	size_t done;
+	struct SpanInput* next;
+} SpanInput;
+
+typedef struct SpanPipeline SpanPipeline;
+
+/**
+ * A callback receiving len bytes of output lines in staging memory, valid until released with spanPipelineRelease.
+ */
+typedef void (*SpanOutputFn)(void* ctx, const char* data, size_t len);
+
+/**
+ * A callback receiving a span of input the pipeline no longer needs.
+ */
+typedef void (*SpanAckFn)(void* ctx, SpanInput* input);
+
+SpanPipeline* spanPipelineCreate(size_t stagingBytes, SpanOutputFn output, SpanAckFn ack, void* ctx);
+void spanPipelineSubmit(SpanPipeline* sp, SpanInput* input);
+void spanPipelineRelease(SpanPipeline* sp, size_t len);
+void spanPipelineFinish(SpanPipeline* sp);
+int spanPipelineDone(const SpanPipeline* sp);
+void spanPipelineDestroy(SpanPipeline* sp);
+
+#endif
@@ -14,129 +14,731 @@
  * 2. Run the program with ./line_processor.
  * 3. Provide input to the program, and it will print the processed output.
 */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <getopt.h>
 #include <pthread.h>
 #include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "line_processor.h"
 
 #define NUM_BUFFS 3
+#define NUM_THREADS 4
 #define MAX_LINES 50
 #define LINE_SIZE 1000
+#define QUEUE_SIZE (MAX_LINES * LINE_SIZE)
 #define PRINT_SIZE 80
+#define CACHE_WAYS 4
+#define STAGING_SIZE (1 << 20)
+#define PREALLOC_SIZE (64 << 20)
+#define WRITEBACK_SIZE (8 << 20)
+#define DIRECT_ALIGN 4096
+#define COROUTINE_STACK (256 << 10)
+#define REALTIME_STACK (256 << 10)
+#define EVENT_IO_SIZE (1 << 16)
+#define PIPE_MIN_CHUNK (1 << 12)
+#define MAX_LISTENERS 8
+#define DRR_QUANTUM (16 << 10)
+#define MAX_BRANCHES 4
+#define MAX_SOURCES 8
+#define CACHE_LINE 64
+#define MPMC_SPINS 256
+#define RULE_SIZE 64
+#define AUTOTUNE_RUNS 3
+#define AUTOTUNE_LATENCY 20.0
+#define SCALING_RUNS 3
+#define MAX_WORKERS 256
+#define ROOFLINE_SECONDS 0.5
+#define LATENCY_SECONDS 10
+#define LATENCY_WARMUP 0.1
+#define MEMORY_SHARE 2
+#define MAX_STAGES (NUM_THREADS + MAX_SOURCES)
+#define BENCH_SMALL_STREAMS 16
+#define BENCH_SECONDS 3
+
+/**
+ * @struct Options
+ * @brief A structure holding the optional features selected on the command line.
+ *
+ * All features are disabled by default so that running the program without arguments behaves exactly as the plain
+ * four thread pipeline.
+ *
+ * @var Options::lineCacheBytes
+ * The byte budget of the transformed line cache, or 0 if the cache is disabled.
+ * @var Options::cacheDir
+ * The directory of the whole-input result cache, or NULL if the cache is disabled.
+ * @var Options::follow
+ * A flag that makes the input thread wait for data appended to stdin instead of stopping at end of file.
+ * @var Options::outputPath
+ * The path output is written to instead of stdout, or NULL to write to stdout.
+ * @var Options::rotateBytes
+ * The maximum number of bytes per output file, or 0 to not rotate by size.
+ * @var Options::rotateLines
+ * The maximum number of lines per output file, or 0 to not rotate by line count.
+ * @var Options::compress
+ * A flag that makes the finalizer thread compress closed output files with gzip.
+ * @var Options::direct
+ * A flag that makes output files bypass the page cache with O_DIRECT.
+ * @var Options::coroutines
+ * A flag that runs every pipeline role as a coroutine on the main thread instead of on its own thread.
+ * @var Options::eventLoop
+ * A flag that makes the coroutines use non-blocking stdin and stdout, waiting for readiness with epoll.
+ * @var Options::queueBytes
+ * The capacity in bytes of each buffer between threads.
+ * @var Options::spillMax
+ * The maximum size of the spill file of the buffer in front of the output thread, or 0 to disable spilling.
+ * @var Options::spillDir
+ * The directory the spill file is created in.
+ * @var Options::serve
+ * The paths of the Unix sockets to serve pipelines on, each optionally followed by a colon and the scheduling weight
+ * of its pipelines.
+ * @var Options::nServe
+ * The number of sockets to serve pipelines on, or 0 to process stdin.
+ * @var Options::pipelineBudget
+ * The maximum number of bytes each server pipeline may reserve, or 0 to size its buffers by queueBytes alone.
+ * @var Options::globalBudget
+ * The maximum number of bytes all server pipelines may reserve together, or 0 for no limit.
+ * @var Options::drrQuantum
+ * The number of input bytes a server pipeline of weight 1 may admit per scheduling round, or 0 for plain round robin.
+ * @var Options::benchStreams
+ * The socket paths of the bulk and small streams of the stream mix benchmark, or NULL to not run it.
+ * @var Options::zeroCopy
+ * A flag that processes stdin through the zero-copy span interface instead of the four stage pipeline.
+ * @var Options::teePath
+ * The path a tee branch writes the input formatted without the plus sign rule to, or NULL for no tee branch.
+ * @var Options::teeWidth
+ * The number of characters per output line of the tee branch.
+ * @var Options::inputs
+ * The paths of the input files merged into the pipeline instead of reading stdin.
+ * @var Options::nInputs
+ * The number of input files, or 0 to read stdin.
+ * @var Options::mergeOrder
+ * A flag that merges the input files in the order they were given instead of interleaving their lines by arrival.
+ * @var Options::mpmcQueues
+ * A flag that backs the buffers between stages by the multi-producer multi-consumer queue instead of the ring, 2 if
+ * it was set by the profile.
+ * @var Options::rulesPath
+ * The path of the file the replacement rules of the transform stages are loaded and reloaded from, or NULL to use the
+ * built in rules.
+ * @var Options::spins
+ * The number of times a stage waiting on a queue backed buffer checks it again before sleeping.
+ * @var Options::ioBytes
+ * The size of the stdio buffers of stdin and stdout when they are not pipes, or 0 for the stdio default.
+ * @var Options::autotune
+ * The path of the input the autotuner runs its trials on, or NULL to not run it.
+ * @var Options::latencyMax
+ * The largest queueing latency in milliseconds the autotuner accepts.
+ * @var Options::benchScaling
+ * The path of the input the core scaling benchmark runs on, or NULL to not run it.
+ * @var Options::benchWorkers
+ * The largest number of pipelines the core scaling benchmark runs in parallel.
+ * @var Options::benchCsv
+ * The path of the CSV file the core scaling benchmark writes.
+ * @var Options::benchRoofline
+ * The path of the input the memory bandwidth benchmark runs on, or NULL to not run it.
+ * @var Options::benchLatency
+ * The rate in lines per second and optionally the duration of the open loop latency benchmark, or NULL to not run it.
+ * @var Options::realtime
+ * A flag that prefaults and locks the pipeline's memory at startup and reports the longest stage stall.
+ * @var Options::realtimePriority
+ * The SCHED_FIFO priority of the pipeline's threads in real-time mode, or 0 to keep the default policy.
+ */
+typedef struct {
+	size_t lineCacheBytes;
+	const char* cacheDir;
+	int follow;
+	const char* outputPath;
+	size_t rotateBytes, rotateLines;
+	int compress;
+	int direct;
+	int coroutines;
+	int eventLoop;
+	size_t queueBytes;
+	size_t spillMax;
+	const char* spillDir;
+	const char* serve[MAX_LISTENERS];
+	int nServe;
+	size_t pipelineBudget, globalBudget;
+	size_t drrQuantum;
+	const char* benchStreams;
+	int zeroCopy;
+	const char* teePath;
+	size_t teeWidth;
+	const char* inputs[MAX_SOURCES];
+	int nInputs;
+	int mergeOrder;
+	int mpmcQueues;
+	const char* rulesPath;
+	int spins;
+	size_t ioBytes;
+	const char* autotune;
+	double latencyMax;
+	const char* benchScaling;
+	int benchWorkers;
+	const char* benchCsv;
+	const char* benchRoofline;
+	const char* benchLatency;
+	int realtime;
+	int realtimePriority;
+} Options;
+
+Options opts = {.queueBytes = QUEUE_SIZE, .spillDir = "/tmp", .drrQuantum = DRR_QUANTUM, .teeWidth = PRINT_SIZE,
+		.spins = MPMC_SPINS, .latencyMax = AUTOTUNE_LATENCY, .benchCsv = "scaling.csv"};
+
+/**
+ * @struct Line
+ * @brief A structure representing a single line of text as it travels through the pipeline.
+ *
+ * @var Line::text
+ * The characters of the line, including the line separator until it is replaced.
+ * @var Line::key
+ * The hash of the raw line computed by the line cache, or 0 if the line was not looked up.
+ * @var Line::cached
+ * A flag set when text already holds the fully transformed line taken from the line cache.
+ * @var Line::stop
+ * A flag set by the input stage on the line that ends the input, after passing on which every stage stops.
+ * @var Line::raw
+ * The raw line a line cache miss was looked up with, carried to the stage that stores its transform.
+ * @var Line::rawLen
+ * The number of characters of raw, or 0 if the line carries no raw line.
+ */
+typedef struct {
+	char text[LINE_SIZE];
+	uint64_t key;
+	int cached;
+	int stop;
+	char raw[LINE_SIZE];
+	size_t rawLen;
+} Line;
+
+/**
+ * @struct Record
+ * @brief A structure describing a line stored in a Buffer, followed in the buffer by the characters of the line and
+ * of the raw line it carries, if any.
+ *
+ * Records are padded to a multiple of sizeof(Record) so every header in the buffer stays aligned.
+ *
+ * @var Record::len
+ * The number of characters of the line, or RECORD_WRAP for a marker telling the consumer to continue at the start.
+ * @var Record::rawLen
+ * The number of characters of the raw line.
+ * @var Record::cached
+ * The cached flag of the line.
+ * @var Record::stop
+ * The stop flag of the line.
+ * @var Record::refs
+ * The number of branches consuming the buffer that have not read the line yet.
+ * @var Record::key
+ * The line cache key of the line.
+ */
+typedef struct {
+	uint16_t len;
+	uint16_t rawLen;
+	uint8_t cached;
+	uint8_t stop;
+	int16_t refs;
+	uint64_t key;
+} Record;
+
+#define RECORD_WRAP UINT16_MAX
+
+/**
+ * @struct MpmcSlot
+ * @brief A structure holding one line in a Buffer backed by a bounded multi-producer multi-consumer queue.
+ *
+ * @var MpmcSlot::seq
+ * The sequence number of the slot: its position in the queue when it is free for the producer claiming that
+ * position, and the position plus one once the line is stored and the consumer claiming it may read it.
+ * @var MpmcSlot::len
+ * The number of characters of the line.
+ * @var MpmcSlot::cached
+ * The cached flag of the line.
+ * @var MpmcSlot::stop
+ * The stop flag of the line.
+ * @var MpmcSlot::key
+ * The line cache key of the line.
+ * @var MpmcSlot::text
+ * The characters of the line.
+ */
+typedef struct {
+	size_t seq;
+	uint32_t len;
+	int cached;
+	int stop;
+	uint64_t key;
+	char text[LINE_SIZE];
+} MpmcSlot;
+
+/**
+ * @brief Computes the number of buffer bytes taken by a record holding a line of the given length.
+ *
+ * @param len The number of characters of the line.
+ * @return The size of the record header and characters, padded to a multiple of sizeof(Record).
+ */
+size_t recordSize(size_t len) {
+	return (sizeof(Record) + len + sizeof(Record) - 1) / sizeof(Record) * sizeof(Record);
+}
+
+/**
+ * @brief Copies a line and the raw line it carries into a record.
+ *
+ * @param rec A pointer to the Record, followed by room for recordSize(len + input->rawLen) bytes in total.
+ * @param input A pointer to the Line to copy.
+ * @param len The number of characters of the line.
+ */
+void recordWrite(Record* rec, const Line* input, size_t len) {
+	rec->len = len;
+	rec->rawLen = input->rawLen;
+	rec->cached = input->cached;
+	rec->stop = input->stop;
+	rec->key = input->key;
+	memcpy(rec + 1, input->text, len);
+	memcpy((char*) (rec + 1) + len, input->raw, input->rawLen);
+}
+
+/**
+ * @brief Copies a line and the raw line it carries out of a record.
+ *
+ * @param rec A pointer to the Record.
+ * @param output A pointer to the Line that will store the line.
+ */
+void recordRead(const Record* rec, Line* output) {
+	memcpy(output->text, rec + 1, rec->len);
+	output->text[rec->len] = '\0';
+	output->rawLen = rec->rawLen;
+	memcpy(output->raw, (const char*) (rec + 1) + rec->len, rec->rawLen);
+	output->key = rec->key;
+	output->cached = rec->cached;
+	output->stop = rec->stop;
+}
 
 /**
  * @struct Buffer
- * @brief A structure representing a buffer that holds lines of text.
+ * @brief A structure representing a bounded ring buffer that holds lines of text.
+ *
+ * The Buffer structure holds a ring of bytes in which lines are stored back to back as variable length records, as
+ * well as several variables to keep track of the current count of lines, bytes in use, producer offset, and consumer
+ * offset. The capacity is expressed in bytes, so short lines take only the space they need. A record never wraps
+ * around the end of the ring; when it does not fit before the end, the producer leaves a RECORD_WRAP marker (or just
+ * the gap, if it is smaller than a header) and continues at the start. Additionally, a pthread_mutex_t and two
+ * pthread_cond_t are included for synchronization purposes when multiple threads access the buffer.
  *
- * The Buffer structure holds a 2D array of characters to store multiple lines of text, as well as several variables
- * to keep track of the current count of lines, producer index, and consumer index. Additionally, a pthread_mutex_t
- * and a pthread_cond_t are included for synchronization purposes when multiple threads access the buffer.
+ * A buffer may feed several branches of the pipeline, each consuming every line in order at its own pace. Every record
+ * then counts the branches that still have to read it, and its space is only freed once the last branch has read it,
+ * so the lines are stored once however many branches read them.
+ *
+ * Instead of the ring, a buffer may be backed by a bounded queue of fixed size slots that any number of producers and
+ * consumers use without taking the mutex (after Dmitry Vyukov's bounded MPMC queue). Every slot has a sequence number
+ * telling whether it is free or holds a line for the position a producer or consumer claimed with a compare and swap,
+ * so stages only contend on the positions themselves. The mutex and condition variables are then only used by stages
+ * that have spun for a while without finding a free slot or a line, and are only signalled while one is sleeping.
+ *
+ * A buffer with a single branch, a single producer and a single consumer may also have a spill file. When the ring is
+ * full, records are appended to the file instead, and once anything is in the file, every new record goes there too, so
+ * the ring always holds the oldest records. The consumer drains the ring first and then the file, in order. The file is
+ * used as a ring of spillMax bytes, so space the consumer has drained is reused right away and the producer only waits
+ * when the file really holds spillMax bytes. Each side reserves its record under the mutex and reads or writes the file
+ * without it, so disk latency never blocks the other side.
  *
  * @var Buffer::buff
- * A 2D array of characters that can store up to MAX LINES lines, each with a maximum length of LINE SIZE.
+ * The ring of size bytes holding the records.
+ * @var Buffer::size
+ * The capacity of the ring in bytes, a multiple of sizeof(Record).
+ * @var Buffer::used
+ * The number of bytes between the consumer and producer offsets, including wrap gaps.
  * @var Buffer::count
- * The current number of lines stored in the buffer.
+ * The current number of lines stored in the buffer, including lines in the spill file, until every branch read them.
  * @var Buffer::iProd
- * The index at which the next line will be produced (written) in the buffer.
+ * The offset at which the next record will be produced (written) in the buffer.
  * @var Buffer::iCon
- * The index at which the next line will be consumed (read) from the buffer.
+ * The offset of the oldest record not yet read by every branch, which is freed next.
  * @var Buffer::mutex
  * A mutex used to synchronize access to the buffer.
  * @var Buffer::full
  * A condition variable used to signal when the buffer has at least one line available for consumption.
+ * @var Buffer::empty
+ * A condition variable used to signal when the buffer has freed space for production.
+ * @var Buffer::spillFd
+ * The file descriptor of the spill file, or -1 if the buffer does not spill.
+ * @var Buffer::spillMax
+ * The maximum number of bytes in the spill file, a multiple of sizeof(Record).
+ * @var Buffer::spillRead
+ * The offset of the next record to consume from the spill file, counted from the start of spilling, so that its
+ * position in the file is spillRead modulo spillMax.
+ * @var Buffer::spillWrite
+ * The offset at which the next record will be appended to the spill file, counted like spillRead. Records between
+ * spillRead and spillWrite are stored or still being written.
+ * @var Buffer::spilled
+ * The number of lines in the spill file.
+ * @var Buffer::peak
+ * The largest number of bytes ever in use in the ring.
+ * @var Buffer::peakCount
+ * The largest number of lines ever stored in the buffer.
+ * @var Buffer::cancelled
+ * A flag set when the pipeline the buffer belongs to is cancelled, making getBuff and putBuff return early.
+ * @var Buffer::branches
+ * The number of branches consuming the buffer.
+ * @var Buffer::iRead
+ * The offset at which each branch will consume (read) its next record from the buffer.
+ * @var Buffer::unread
+ * The number of lines each branch has not read yet.
+ * @var Buffer::producers
+ * The number of stages producing lines into the buffer.
+ * @var Buffer::slots
+ * The slots of the queue backing the buffer instead of the ring, or NULL if it is backed by the ring.
+ * @var Buffer::mask
+ * The number of slots minus one, the number of slots being a power of two.
+ * @var Buffer::enqueuePos
+ * The position the next producer claims, on a cache line of its own.
+ * @var Buffer::dequeuePos
+ * The position the next consumer claims, on a cache line of its own.
+ * @var Buffer::sleepingProducers
+ * The number of producers sleeping on the empty condition variable until a slot is freed.
+ * @var Buffer::sleepingConsumers
+ * The number of consumers sleeping on the full condition variable until a line is stored.
  */
 typedef struct {
-	char buff[MAX_LINES][LINE_SIZE];
-	int count, iProd, iCon;
+	char* buff;
+	size_t size, used, peak;
+	int count, peakCount;
+	size_t iProd, iCon;
 	pthread_mutex_t mutex;
 	pthread_cond_t full;
+	pthread_cond_t empty;
+	int spillFd;
+	off_t spillMax, spillRead, spillWrite;
+	int spilled;
+	int cancelled;
+	int branches;
+	size_t iRead[MAX_BRANCHES];
+	int unread[MAX_BRANCHES];
+	int producers;
+	MpmcSlot* slots;
+	size_t mask;
+	char enqueuePad[CACHE_LINE];
+	size_t enqueuePos;
+	char dequeuePad[CACHE_LINE - sizeof(size_t)];
+	size_t dequeuePos;
+	char sleepPad[CACHE_LINE - sizeof(size_t)];
+	int sleepingProducers, sleepingConsumers;
 } Buffer;
 
-Buffer buffers[NUM_BUFFS];
+/**
+ * @brief Initializes a buffer with the given capacity.
+ *
+ * @param buffer A pointer to the Buffer to initialize.
+ * @param size The capacity in bytes, rounded down to a multiple of sizeof(Record), or for a queue to the largest power
+ * of two number of slots that fits, but at least two.
+ * @param mpmc 1 to back the buffer by the multi-producer multi-consumer queue, or 0 to back it by the ring.
+ * @return 0 on success, or -1 if the ring or the slots could not be allocated.
+ */
+int bufferInit(Buffer* buffer, size_t size, int mpmc) {
+	memset(buffer, 0, sizeof(*buffer));
+	buffer->spillFd = -1;
+	buffer->branches = buffer->producers = 1;
+	if (mpmc) {
+		size_t slots = 2;
+		while (2 * slots * sizeof(MpmcSlot) <= size)
+			slots *= 2;
+		buffer->size = slots * sizeof(MpmcSlot);
+		if (!(buffer->slots = malloc(buffer->size)))
+			return -1;
+		for (size_t i = 0; i < slots; i++)
+			buffer->slots[i].seq = i;
+		buffer->mask = slots - 1;
+	} else {
+		buffer->size = size / sizeof(Record) * sizeof(Record);
+		if (!(buffer->buff = malloc(buffer->size)))
+			return -1;
+	}
+	pthread_mutex_init(&buffer->mutex, NULL);
+	pthread_cond_init(&buffer->full, NULL);
+	pthread_cond_init(&buffer->empty, NULL);
+	return 0;
+}
 
 /**
- * @brief Retrieves a line of text from the specified buffer and stores it in the output array.
+ * @brief Frees a buffer.
  *
- * The getBuff function locks the buffer's mutex, then waits for the buffer's count to be greater than zero, ensuring
- * that there is a line available for consumption. Once a line is available, the function copies the line from the
- * buffer to the output array, updates the buffer's count, and unlocks the mutex.
+ * @param buffer A pointer to the Buffer to free.
+ */
+void bufferDestroy(Buffer* buffer) {
+	free(buffer->buff);
+	free(buffer->slots);
+	if (buffer->spillFd >= 0)
+		close(buffer->spillFd);
+	pthread_mutex_destroy(&buffer->mutex);
+	pthread_cond_destroy(&buffer->full);
+	pthread_cond_destroy(&buffer->empty);
+}
+
+/**
+ * @brief Computes the number of free bytes a buffer needs to store a record at its producer offset.
  *
- * @param buffer A pointer to the Buffer structure from which a line of text will be retrieved.
- * @param output A character array that will store the retrieved line of text.
+ * @param buffer A pointer to the Buffer to store the record in.
+ * @param size The size of the record, see recordSize.
+ * @return The size of the record, plus the gap left at the end of the ring if the record must wrap.
  */
-void getBuff(Buffer* buffer, char output[]) {
-	// Lock mutex and wait until count > 0
-	pthread_mutex_lock(&buffer->mutex);
-	while (!buffer->count)
-		pthread_cond_wait(&buffer->full, &buffer->mutex);
-	
-	// Copy output to buffer, increment vars, and unlock mutex
-	strcpy(output, buffer->buff[buffer->iCon++]);
-	buffer->count--;
-	pthread_mutex_unlock(&buffer->mutex);
+size_t bufferNeed(Buffer* buffer, size_t size) {
+	return buffer->iProd + size > buffer->size ? size + buffer->size - buffer->iProd : size;
 }
 
 /**
- * @brief Replaces all occurrences of a specified substring within a string with a single replacement character.
+ * @brief Gives a buffer an anonymous spill file.
  *
- * The replaceSubstring function searches for all occurrences of the specified 'remove' substring within the input
- * 'str'. When a match is found, the function replaces the substring with the 'replace' character and moves the
- * remaining characters in the string to fill the gap left by the removed substring. The process is repeated until
- * no more occurrences of the substring are found.
+ * @param buffer A pointer to the Buffer that will spill.
+ * @param dir The directory to create the spill file in.
+ * @param max The maximum number of bytes in the spill file, rounded down to a multiple of sizeof(Record) so that no
+ * record header wraps around the end of the file.
+ * @return 0 on success, or -1 if the file could not be created.
+ */
+int bufferSpillInit(Buffer* buffer, const char* dir, size_t max) {
+	// Create an unnamed file, or a named one that is unlinked right away
+	int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/line_processor.XXXXXX", dir);
+		if ((fd = mkstemp(path)) < 0)
+			return -1;
+		unlink(path);
+	}
+	buffer->spillFd = fd;
+	buffer->spillMax = max / sizeof(Record) * sizeof(Record);
+	return 0;
+}
+
+/**
+ * @brief Determines where a record can be stored in a buffer right now.
  *
- * @param str A pointer to the input string in which the specified substring will be replaced.
- * @param remove A pointer to the substring that will be replaced within the input string.
- * @param replace The replacement character that will be used to replace the specified substring.
+ * @param buffer A pointer to the Buffer to store the record in.
+ * @param size The size of the record, see recordSize.
+ * @return 1 to store it in the ring, 2 to append it to the spill file, or 0 if the producer must wait.
  */
-void replaceSubstring(char* str, char* remove, char replace) {
-	const size_t remove_len = strlen(remove);
-	
-	// Replace remove with reaplce until str does not contain remove
-	while ((str = strstr(str, remove))) {
-		*str = replace;
-		memmove(str + 1, str + remove_len, strlen(str + remove_len) + 1);
+int bufferRoom(Buffer* buffer, size_t size) {
+	if (buffer->spillWrite == buffer->spillRead && buffer->size - buffer->used >= bufferNeed(buffer, size))
+		return 1;
+	if (buffer->spillFd >= 0 && buffer->spillWrite - buffer->spillRead + (off_t) size <= buffer->spillMax)
+		return 2;
+	return 0;
+}
+
+/**
+ * @brief Reads the oldest record of a buffer's spill file.
+ *
+ * The bufferUnspill function reads the record with a single pread of the longest possible record, or two if the record
+ * wraps around the end of the file. It is called without the buffer's mutex: the producer never overwrites the record
+ * before the consumer moves spillRead past it.
+ *
+ * @param buffer A pointer to the Buffer whose spill file is read.
+ * @param offset The offset of the record, spillRead when it was reserved.
+ * @param output A pointer to the Line that will store the line of the record.
+ * @return The size of the record in the file.
+ */
+size_t bufferUnspill(Buffer* buffer, off_t offset, Line* output) {
+	char data[recordSize(2 * LINE_SIZE)] __attribute__((aligned(sizeof(Record))));
+	const Record* rec = (const Record*) data;
+	const off_t pos = offset % buffer->spillMax, before = buffer->spillMax - pos;
+	const ssize_t n = pread(buffer->spillFd, data, before < (off_t) sizeof(data) ? before : (off_t) sizeof(data), pos);
+	const off_t size = n >= (ssize_t) sizeof(Record) ? (off_t) recordSize(rec->len + rec->rawLen) : 0;
+
+	// Read the rest of a record that wraps from the start of the file
+	if (!size || (size <= before ? n < size : n < before
+			|| pread(buffer->spillFd, data + before, size - before, 0) != size - before)) {
+		fprintf(stderr, "spill: cannot read spill file: %s\n", strerror(errno));
+		exit(1);
 	}
+	recordRead(rec, output);
+	return size;
 }
 
 /**
- * @brief Stores a line of text in the specified buffer.
+ * @brief Writes a record to a buffer's spill file, wrapping around the end of the file if needed.
  *
- * The putBuff function locks the buffer's mutex, then copies the input line of text to the buffer using the buffer's
- * iProd index. It increments the buffer's count and signals that the buffer is not empty using the buffer's full
- * condition variable. Finally, the function unlocks the buffer's mutex.
+ * The bufferSpill function is called without the buffer's mutex, on space the producer reserved by moving spillWrite.
  *
- * @param buffer A pointer to the Buffer structure where the input line of text will be stored.
- * @param input A character array containing the line of text to be stored in the buffer.
+ * @param buffer A pointer to the Buffer whose spill file is written.
+ * @param offset The offset reserved for the record, spillWrite before it was moved.
+ * @param input A pointer to the Line to store.
+ * @param len The number of characters of the line.
  */
-void putBuff(Buffer* buffer, char input[]) {
-	// Lock mutex, copy input to buffer and increment vars
-	pthread_mutex_lock(&buffer->mutex);
-	strcpy(buffer->buff[buffer->iProd++], input);
-	buffer->count++;
-	
-	// Signal buffer full and unlock
-	pthread_cond_signal(&buffer->full);
-	pthread_mutex_unlock(&buffer->mutex);
+void bufferSpill(Buffer* buffer, off_t offset, Line* input, size_t len) {
+	char data[recordSize(2 * LINE_SIZE)] __attribute__((aligned(sizeof(Record))));
+	Record* rec = (Record*) data;
+	recordWrite(rec, input, len);
+
+	const off_t size = recordSize(len + input->rawLen), pos = offset % buffer->spillMax;
+	const off_t first = size < buffer->spillMax - pos ? size : buffer->spillMax - pos;
+	if (pwrite(buffer->spillFd, data, first, pos) != first
+			|| (size > first && pwrite(buffer->spillFd, data + first, size - first, 0) != size - first)) {
+		fprintf(stderr, "spill: cannot write spill file: %s\n", strerror(errno));
+		exit(1);
+	}
 }
 
+struct Pipeline;
+
 /**
- * @brief Formats and prints the input text with a fixed width of PRINT_SIZE characters per line.
+ * @struct Coroutine
+ * @brief A structure representing one task run as a coroutine, usually one stage of a pipeline.
  *
- * The printOutput function appends the input text to an internal static buffer. It then checks if the length of the
- * buffer is greater than or equal to PRINT_SIZE. If so, the function prints the first PRINT_SIZE characters of the
- * buffer as a line, and shifts the remaining characters in the buffer to the beginning. This process is repeated
- * until the length of the buffer is less than PRINT_SIZE.
+ * In coroutine mode every stage of the pipeline runs on its own stack on the main thread. A coroutine runs until its
+ * input buffer is empty or its output buffer is full, then yields back to the scheduler, which resumes the next one.
+ * Since only one coroutine runs at a time, the buffers need no mutexes or condition variables. A coroutine may also
+ * wait for a file descriptor to become ready, in which case the scheduler skips it until epoll reports the event.
  *
- * @param input A pointer to the input text that will be formatted and printed with fixed width.
+ * @var Coroutine::context
+ * The saved registers and stack of the coroutine.
+ * @var Coroutine::stack
+ * The stack of COROUTINE_STACK bytes the coroutine runs on.
+ * @var Coroutine::fn
+ * The function the coroutine runs.
+ * @var Coroutine::args
+ * The argument passed to fn, e.g. a pointer to the ThreadArgs structure of a stage.
+ * @var Coroutine::pipeline
+ * A pointer to the Pipeline the coroutine is a stage of, or NULL.
+ * @var Coroutine::done
+ * A flag set once fn has returned.
+ * @var Coroutine::waitFd
+ * The file descriptor the coroutine waits for, or -1 if it is runnable.
+ * @var Coroutine::next
+ * A pointer to the next coroutine in the scheduler's list.
  */
-void printOutput(char* input) {
-	// Init static string output and concatinate with input
-	static char output[LINE_SIZE * MAX_LINES] = {0};
-	strcat(output, input);
-	
-	// Loop over output, printing 80 chars at a time
-	while (strlen(output) >= PRINT_SIZE) {
-		printf("%.*s\n", PRINT_SIZE, output);
-		memmove(output, output + PRINT_SIZE, strlen(output + PRINT_SIZE) + 1);
+typedef struct Coroutine {
+	ucontext_t context;
+	char* stack;
+	void* (*fn)(void*);
+	void* args;
+	struct Pipeline* pipeline;
+	int done;
+	int waitFd;
+	struct Coroutine* next;
+} Coroutine;
+
+ucontext_t schedulerContext;
+Coroutine* currentCoroutine;
+Coroutine* coroutineList;
+Coroutine** coroutineTail = &coroutineList;
+unsigned long coroutineProgress;
+int epollFd = -1;
+
+/**
+ * @brief Suspends the running coroutine and returns to the scheduler.
+ */
+void coroutineYield(void) {
+	swapcontext(&currentCoroutine->context, &schedulerContext);
+}
+
+/**
+ * @brief Suspends the running coroutine until a file descriptor is ready.
+ *
+ * The coroutineWaitFd function registers the file descriptor with epoll and yields. The scheduler does not resume the
+ * coroutine until epoll reports the requested events. File descriptors epoll cannot watch, such as regular files,
+ * are always ready, so the function returns right away for them.
+ *
+ * @param fd The file descriptor to wait for.
+ * @param events The epoll events to wait for, e.g. EPOLLIN.
+ */
+void coroutineWaitFd(int fd, uint32_t events) {
+	struct epoll_event ev = {.events = events, .data.ptr = currentCoroutine};
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev))
+		return;
+	currentCoroutine->waitFd = fd;
+	coroutineYield();
+}
+
+/**
+ * @struct IoBuffer
+ * @brief A structure holding data read from a pipeline's input or waiting to be written to its output without stdio.
+ *
+ * The buffers are used for non-blocking stdin and stdout in event loop mode, for the connections of server mode, and
+ * for stdout when it is a pipe, where the size of each write adapts to how full the pipe is.
+ *
+ * @var IoBuffer::buff
+ * The buffered bytes.
+ * @var IoBuffer::size
+ * The capacity of buff in bytes.
+ * @var IoBuffer::start
+ * The index of the first buffered byte not yet consumed or written.
+ * @var IoBuffer::end
+ * The index just past the last buffered byte.
+ * @var IoBuffer::chunk
+ * The number of buffered output bytes at which the buffer is written.
+ * @var IoBuffer::pipeSize
+ * The capacity of the pipe behind the file descriptor, or 0 if it is not a pipe.
+ * @var IoBuffer::eof
+ * A flag set once the file descriptor has reached end of file.
+ */
+typedef struct {
+	char* buff;
+	size_t size, start, end, chunk;
+	int pipeSize;
+	int eof;
+} IoBuffer;
+
+/**
+ * @brief Raises the capacity of a pipe as far as the system allows.
+ *
+ * The pipeGrow function tries the limit in /proc/sys/fs/pipe-max-size first, halving the size whenever the kernel
+ * refuses it, e.g. because the user has too many large pipes already.
+ *
+ * @param fd The file descriptor that may refer to a pipe.
+ * @return The capacity of the pipe in bytes, or 0 if fd is not a pipe.
+ */
+int pipeGrow(int fd) {
+	struct stat st;
+	if (fstat(fd, &st) || !S_ISFIFO(st.st_mode))
+		return 0;
+
+	// Find the system limit
+	int max = 1 << 20;
+	FILE* limit = fopen("/proc/sys/fs/pipe-max-size", "r");
+	if (limit) {
+		if (fscanf(limit, "%d", &max) != 1)
+			max = 1 << 20;
+		fclose(limit);
+	}
+
+	// Grow the pipe as far as allowed
+	const int size = fcntl(fd, F_GETPIPE_SZ);
+	for (int try = max; try > size; try /= 2)
+		if (fcntl(fd, F_SETPIPE_SZ, try) >= 0)
+			break;
+	return fcntl(fd, F_GETPIPE_SZ);
+}
+
+/**
+ * @brief Allocates an IoBuffer for the input or output of a pipeline.
+ *
+ * @param io A pointer to the IoBuffer to allocate.
+ * @param pipeSize The capacity of the pipe behind the file descriptor, or 0 if it is not a pipe.
+ */
+void ioBufferInit(IoBuffer* io, int pipeSize) {
+	io->pipeSize = pipeSize;
+	io->size = pipeSize > EVENT_IO_SIZE ? pipeSize : EVENT_IO_SIZE;
+	io->chunk = pipeSize ? PIPE_MIN_CHUNK : io->size;
+	if (!(io->buff = malloc(io->size))) {
+		fprintf(stderr, "io: out of memory\n");
+		exit(1);
 	}
 }
 
@@ -152,7 +754,8 @@ void printOutput(char* input) {
  * @var ThreadArgs::iBuffer
  * The index of the buffer being used by the thread.
  * @var ThreadArgs::stopStr
- * A pointer to the stop string that indicates the end of processing.
+ * A pointer to the line that ends the input, which the input stage passes on with its stop flag set, as it does at the
+ * end of the input. NULL for the other stages, which stop on the flag, as their rules may rewrite the line.
  * @var ThreadArgs::searchStr
  * A pointer to the search string that will be replaced within the input text.
  * @var ThreadArgs::replaceChar
@@ -161,6 +764,22 @@ void printOutput(char* input) {
  * A flag that determines whether the thread reads from a buffer (1) or stdin (0).
  * @var ThreadArgs::writeBuff
  * A flag that determines whether the thread writes to a buffer (1) or calls printOutput (0).
+ * @var ThreadArgs::cacheLookup
+ * A flag set on the first transform thread when the line cache is enabled, making it look up each raw line.
+ * @var ThreadArgs::cacheStore
+ * A flag set on the last transform thread when the line cache is enabled, making it store each transformed line.
+ * @var ThreadArgs::pipeline
+ * A pointer to the Pipeline the thread is a stage of.
+ * @var ThreadArgs::branch
+ * The index of the thread's branch among the branches consuming its input buffer.
+ * @var ThreadArgs::tee
+ * A pointer to the TeeOutput the thread formats lines to instead of calling printOutput, or NULL.
+ * @var ThreadArgs::source
+ * A pointer to the Source an input thread reads instead of stdin, or NULL.
+ * @var ThreadArgs::epoch
+ * The rules epoch the thread entered while it uses the rule table, or 0 while it does not.
+ * @var ThreadArgs::stall
+ * The longest time in seconds the thread took to pass on a line after getting it, measured in real-time mode.
  */
 typedef struct {
 	int iBuffer;
@@ -169,86 +788,4687 @@ typedef struct {
 	char replaceChar;
 	int readBuff; // 1 for getBuff, 0 for fgets
 	int writeBuff; // 1 for putBuff, 0 for printOutput
+	int cacheLookup, cacheStore;
+	struct Pipeline* pipeline;
+	int branch;
+	struct TeeOutput* tee;
+	struct Source* source;
+	unsigned long epoch;
+	double stall;
 } ThreadArgs;
 
 /**
- * @brief The main processing function executed by each thread.
+ * @struct Source
+ * @brief A structure describing one of several input files merged into a pipeline, each read by its own input thread.
  *
- * The processThread function reads lines of text based on the provided ThreadArgs structure. It reads input from either
- * a buffer or stdin and processes the input by replacing specified substrings with a single character, if required.
- * The processed input is then either written to a buffer or printed using the printOutput function. The thread
- * continues processing input until it encounters the specified stop string.
+ * @var Source::path
+ * The path of the input file, opened by its input thread so a FIFO without a writer only holds up that thread.
+ * @var Source::file
+ * The input file, or NULL until it has been opened or if it could not be.
+ * @var Source::index
+ * The position of the source among the merged sources.
+ * @var Source::ahead
+ * The buffer holding the lines read before it is the source's turn when merging in source order.
+ */
+typedef struct Source {
+	const char* path;
+	FILE* file;
+	int index;
+	Buffer ahead;
+} Source;
+
+/**
+ * @struct Pipeline
+ * @brief A structure holding one instance of the four stage pipeline, from its input to its output.
  *
- * @param args A pointer to a ThreadArgs structure containing the arguments required for the processing thread.
- * @return NULL The function returns NULL as it is intended to be used with pthread_create.
+ * The program normally runs a single pipeline between stdin and stdout. In server mode every connection runs its own
+ * pipeline, so a pipeline owns everything its stages touch apart from the shared line cache.
+ *
+ * @var Pipeline::buffers
+ * The buffers between the stages.
+ * @var Pipeline::args
+ * The arguments of each stage.
+ * @var Pipeline::nStages
+ * The number of stages, NUM_THREADS plus one if the pipeline has a tee branch and one per merged source but the first.
+ * @var Pipeline::inFd
+ * The file descriptor input is read from when it is read without stdio.
+ * @var Pipeline::outFd
+ * The file descriptor output is written to when it is written without stdio.
+ * @var Pipeline::in
+ * The buffer for input read from inFd, with no buff if input is read with stdio.
+ * @var Pipeline::out
+ * The buffer for output written to outFd, with no buff if output is written with stdio or to output files.
+ * @var Pipeline::pending
+ * The output characters printOutput has not yet formed into a full line.
+ * @var Pipeline::cancelled
+ * A flag set by cancelPipeline.
+ * @var Pipeline::readers
+ * The input threads, which cancelPipeline cancels when the stages run as threads.
+ * @var Pipeline::nReaders
+ * The number of input threads that are running and may be cancelled.
+ * @var Pipeline::readersMutex
+ * A mutex used to synchronize cancelPipeline with the creation and joining of the input threads.
+ * @var Pipeline::lines
+ * The number of lines read by the input stage.
+ * @var Pipeline::running
+ * The number of stages of a server pipeline still running.
+ * @var Pipeline::id
+ * The number identifying a server pipeline in the server log.
+ * @var Pipeline::reserved
+ * The number of bytes a server pipeline has reserved from the global memory budget.
+ * @var Pipeline::bytes
+ * The number of bytes read by the input stage.
+ * @var Pipeline::weight
+ * The share of input a server pipeline may admit per scheduling round relative to other pipelines, or 0 if the
+ * pipeline is not scheduled by deficit round robin.
+ * @var Pipeline::deficit
+ * The number of input bytes the pipeline may still admit in the current round, negative if it overdrew its share.
+ * @var Pipeline::round
+ * The scheduling round in which deficit was last refilled.
+ * @var Pipeline::sources
+ * The input files merged into the pipeline, or NULL if it reads a single input.
+ * @var Pipeline::nSources
+ * The number of merged sources.
+ * @var Pipeline::mergeOrder
+ * A flag that passes on the lines of each source only once every earlier source has ended.
+ * @var Pipeline::sourcesEnded
+ * The number of sources that have ended, which is also the index of the source whose turn it is in source order.
+ * @var Pipeline::mergeMutex
+ * A mutex protecting sourcesEnded.
+ * @var Pipeline::mergeTurn
+ * A condition variable used to signal when a source has ended.
  */
-void* processThread(void* args) {
-	// Get args from thread
-	ThreadArgs* tArgs = (ThreadArgs*) args;
-	
-	// Get, modify and write/output line
-	char line[LINE_SIZE];
-	while (strcmp(line, tArgs->stopStr)) {
-		// Populate line string
-		if (tArgs->readBuff)
-			getBuff(&buffers[tArgs->iBuffer - 1], line);
-		else
-			fgets(line, LINE_SIZE, stdin);
+typedef struct Pipeline {
+	Buffer buffers[NUM_BUFFS];
+	ThreadArgs args[MAX_STAGES];
+	int nStages;
+	int inFd, outFd;
+	IoBuffer in, out;
+	char pending[LINE_SIZE + PRINT_SIZE];
+	int cancelled;
+	pthread_t readers[MAX_SOURCES];
+	int nReaders;
+	pthread_mutex_t readersMutex;
+	unsigned long lines;
+	int running;
+	int id;
+	size_t reserved;
+	unsigned long long bytes;
+	int weight;
+	long deficit;
+	unsigned long round;
+	Source* sources;
+	int nSources;
+	int mergeOrder;
+	int sourcesEnded;
+	pthread_mutex_t mergeMutex;
+	pthread_cond_t mergeTurn;
+} Pipeline;
 
-		// Optionally modify line string
-		if (tArgs->searchStr)
-			replaceSubstring(line, tArgs->searchStr, tArgs->replaceChar);
-		
-		// Write/Output line string
-		if (tArgs->writeBuff)
-			putBuff(&buffers[tArgs->iBuffer], line);
-		else
-			printOutput(line);
+/**
+ * The arguments of the four stages, copied into every pipeline by pipelineInit.
+ */
+const ThreadArgs stageArgs[NUM_THREADS] = {
+	{.iBuffer = 0, .stopStr = "STOP\n", .readBuff = 0, .writeBuff = 1},
+	{.iBuffer = 1, .searchStr = "\n", .replaceChar = ' ', .readBuff = 1, .writeBuff = 1},
+	{.iBuffer = 2, .searchStr = "++", .replaceChar = '^', .readBuff = 1, .writeBuff = 1},
+	{.iBuffer = 3, .readBuff = 1, .writeBuff = 0}
+};
+
+/**
+ * The names of the four stages, as reported in real-time mode.
+ */
+const char* const stageNames[NUM_THREADS] = {"input", "separator", "plus", "output"};
+
+Pipeline mainPipeline;
+
+/**
+ * @brief Initializes a pipeline reading stdin with stdio and printing to stdout.
+ *
+ * Callers switch the pipeline to other file descriptors or to reading and writing without stdio by changing inFd and
+ * outFd and allocating in and out with ioBufferInit.
+ *
+ * @param p A pointer to the Pipeline to initialize.
+ * @param queueBytes The capacity in bytes of each buffer between stages.
+ * @return 0 on success, or -1 if the buffers could not be allocated.
+ */
+int pipelineInit(Pipeline* p, size_t queueBytes) {
+	memset(p, 0, sizeof(*p));
+	p->inFd = STDIN_FILENO;
+	p->outFd = STDOUT_FILENO;
+	for (int i = 0; i < NUM_BUFFS; i++)
+		if (bufferInit(&p->buffers[i], queueBytes, opts.mpmcQueues)) {
+			while (i--)
+				bufferDestroy(&p->buffers[i]);
+			return -1;
+		}
+	pthread_mutex_init(&p->readersMutex, NULL);
+
+	// Look up the line cache before the first transform and store after the last
+	p->nStages = NUM_THREADS;
+	for (int i = 0; i < NUM_THREADS; i++) {
+		p->args[i] = stageArgs[i];
+		p->args[i].pipeline = p;
 	}
-	return NULL;
+	if (opts.lineCacheBytes) {
+		p->args[1].cacheLookup = 1;
+		p->args[2].cacheStore = 1;
+	}
+	return 0;
 }
 
 /**
- * @brief The main function of the multi-threaded text processing application.
+ * @brief Frees the buffers of a pipeline and closes its merged sources.
  *
- * The main function initializes the shared buffers, creates four threads with their corresponding ThreadArgs
- * structures, and starts the threads. It then waits for all threads to complete execution and cleans up resources
- * by destroying the mutexes and condition variables associated with the buffers. The program reads input from stdin,
- * processes it using the threads, and prints the formatted output to stdout.
+ * @param p A pointer to the Pipeline to free.
+ */
+void pipelineDestroy(Pipeline* p) {
+	for (int i = 0; i < NUM_BUFFS; i++)
+		bufferDestroy(&p->buffers[i]);
+	for (int i = 0; i < p->nSources; i++) {
+		if (p->sources[i].file)
+			fclose(p->sources[i].file);
+		if (p->mergeOrder)
+			bufferDestroy(&p->sources[i].ahead);
+	}
+	if (p->nSources) {
+		pthread_mutex_destroy(&p->mergeMutex);
+		pthread_cond_destroy(&p->mergeTurn);
+	}
+	pthread_mutex_destroy(&p->readersMutex);
+	free(p->in.buff);
+	free(p->out.buff);
+}
+
+/**
+ * @brief Checks whether a pipeline has been cancelled.
  *
- * @param argc The number of command-line arguments.
- * @param argv An array of pointers to the command-line argument strings.
- * @return 0 The function returns 0 to indicate successful execution.
+ * @param p A pointer to the Pipeline to check.
+ * @return 1 if cancelPipeline was called, or 0 otherwise.
+ */
+int isCancelled(Pipeline* p) {
+	return __atomic_load_n(&p->cancelled, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Stops every stage of a pipeline as soon as possible, e.g. after the reader of its output has gone away.
+ *
+ * The cancelPipeline function sets the cancelled flag of the pipeline and of its buffers and wakes every stage waiting
+ * on a buffer, so that getBuff and putBuff return early. Coroutines of the pipeline waiting for a file descriptor are
+ * made runnable again. The input thread only accepts cancellation while reading stdin, and is cancelled there, so it
+ * stops even if it is blocked waiting for input. Other pipelines are not affected.
+ *
+ * @param p A pointer to the Pipeline to cancel.
  */
-int main(int argc, const char * argv[]) {
-	// Init buffers
-	memset(buffers, 0, sizeof(buffers));
+void cancelPipeline(Pipeline* p) {
+	if (__atomic_exchange_n(&p->cancelled, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	// Wake stages waiting on buffers
 	for (int i = 0; i < NUM_BUFFS; i++) {
-		pthread_mutex_init(&buffers[i].mutex, NULL);
-		pthread_cond_init(&buffers[i].full, NULL);
+		Buffer* buffer = &p->buffers[i];
+		pthread_mutex_lock(&buffer->mutex);
+		buffer->cancelled = 1;
+		pthread_cond_broadcast(&buffer->full);
+		pthread_cond_broadcast(&buffer->empty);
+		pthread_mutex_unlock(&buffer->mutex);
 	}
-	
-	// Init threads & thread arguments
-	pthread_t threads[4];
-	ThreadArgs threadArgs[] = {
-		{0, "STOP\n", NULL, '\0', 0, 1},
-		{1, "STOP ", "\n", ' ', 1, 1},
-		{2, "STOP ", "++", '^', 1, 1},
-		{3, "STOP ", NULL, '\0', 1, 0}
-	};
 
-	// Create threads
-	for (int i = 0; i < 4; i++)
-		pthread_create(&threads[i], NULL, processThread, &threadArgs[i]);
+	// Wake coroutines waiting on file descriptors
+	for (Coroutine* co = coroutineList; co; co = co->next)
+		if (co->pipeline == p && co->waitFd >= 0) {
+			epoll_ctl(epollFd, EPOLL_CTL_DEL, co->waitFd, NULL);
+			co->waitFd = -1;
+		}
 
-	// Join threads
-	for (int i = 0; i < 4; i++)
-		pthread_join(threads[i], NULL);
+	// Wake input threads waiting for their turn
+	if (p->nSources) {
+		pthread_mutex_lock(&p->mergeMutex);
+		pthread_cond_broadcast(&p->mergeTurn);
+		pthread_mutex_unlock(&p->mergeMutex);
+	}
 
-	// Cleanup buffers and exit
-	for (int i = 0; i < NUM_BUFFS; i++) {
-		pthread_mutex_destroy(&buffers[i].mutex);
-		pthread_cond_destroy(&buffers[i].full);
+	// Stop the input threads even if they are blocked reading
+	pthread_mutex_lock(&p->readersMutex);
+	for (int i = 0; i < p->nReaders; i++)
+		pthread_cancel(p->readers[i]);
+	pthread_mutex_unlock(&p->readersMutex);
+}
+
+/**
+ * @brief Reads one line of input from a pipeline's input file descriptor without stdio.
+ *
+ * The eventReadLine function returns the next line from the input buffer, refilling the buffer from the file
+ * descriptor when it does not hold a full line. Each read asks for the whole free space of the buffer, which is sized
+ * to the pipe, so a single read drains a full pipe. When no data is available, the coroutine waits until epoll reports
+ * the file descriptor readable.
+ *
+ * @param p A pointer to the Pipeline to read input for.
+ * @param line A character array of LINE_SIZE characters that will store the line.
+ * @return 0 if a line was read, or -1 if the input has ended or the pipeline was cancelled.
+ */
+int eventReadLine(Pipeline* p, char line[]) {
+	IoBuffer* in = &p->in;
+	for (;;) {
+		// Return a complete line, or what is left at end of file
+		const size_t avail = in->end - in->start;
+		const char* nl = memchr(in->buff + in->start, '\n', avail);
+		size_t len = nl ? (size_t) (nl - in->buff - in->start) + 1 : avail;
+		if (nl || len >= LINE_SIZE - 1 || (in->eof && len)) {
+			len = len < LINE_SIZE - 1 ? len : LINE_SIZE - 1;
+			memcpy(line, in->buff + in->start, len);
+			line[len] = '\0';
+			in->start += len;
+			return 0;
+		}
+		if (in->eof || isCancelled(p))
+			return -1;
+
+		// Move the partial line to the front and refill
+		memmove(in->buff, in->buff + in->start, avail);
+		in->start = 0;
+		in->end = avail;
+		ssize_t n = read(p->inFd, in->buff + in->end, in->size - in->end);
+		if (n > 0)
+			in->end += n;
+		else if (n < 0 && errno == EAGAIN)
+			coroutineWaitFd(p->inFd, EPOLLIN);
+		else if (n == 0 || errno != EINTR)
+			in->eof = 1;
+	}
+}
+
+/**
+ * @brief Writes all buffered output of a pipeline to its output file descriptor.
+ *
+ * The pipelineFlush function writes as much as the file descriptor accepts, keeping the rest after partial writes, and
+ * waits until epoll reports it writable whenever a non-blocking write would block. If the reader of the output has
+ * gone away, the buffered output is dropped and the pipeline is cancelled.
+ *
+ * When the output is a pipe, the function then adapts the size of the next write to the number of bytes still unread
+ * in the pipe. An empty pipe means the reader is waiting and woken by every write, so writes are made larger to wake
+ * it less often. A pipe more than half full means the reader is behind, so writes are made smaller to fit the free
+ * space without blocking.
+ *
+ * @param p A pointer to the Pipeline whose output is written.
+ */
+void pipelineFlush(Pipeline* p) {
+	IoBuffer* out = &p->out;
+	while (out->start < out->end && !isCancelled(p)) {
+		ssize_t n = write(p->outFd, out->buff + out->start, out->end - out->start);
+		if (n > 0)
+			out->start += n;
+		else if (n < 0 && errno == EAGAIN)
+			coroutineWaitFd(p->outFd, EPOLLOUT);
+		else if (n < 0 && (errno == EPIPE || errno == ECONNRESET))
+			cancelPipeline(p);
+		else if (n < 0 && errno != EINTR) {
+			fprintf(stderr, "output: cannot write output: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+	out->start = out->end = 0;
+
+	// Adapt the write size to the pipe fill level
+	int unread;
+	if (out->pipeSize && !ioctl(p->outFd, FIONREAD, &unread)) {
+		if (!unread && out->chunk * 2 <= (size_t) out->pipeSize / 2)
+			out->chunk *= 2;
+		else if (unread > out->pipeSize / 2 && out->chunk / 2 >= PIPE_MIN_CHUNK)
+			out->chunk /= 2;
+	}
+}
+
+/**
+ * @brief Buffers output of a pipeline, writing the buffer once it reaches the current write size.
+ *
+ * @param p A pointer to the Pipeline whose output is written.
+ * @param data A pointer to the bytes to write.
+ * @param len The number of bytes to write.
+ */
+void pipelineWrite(Pipeline* p, const char* data, size_t len) {
+	if (p->out.end + len > p->out.chunk)
+		pipelineFlush(p);
+	memcpy(p->out.buff + p->out.end, data, len);
+	p->out.end += len;
+}
+
+/**
+ * @brief Tells the processor the caller is spinning.
+ */
+void cpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * @brief Waits until the slot at a position of a queue backed buffer is ready, spinning and yielding before sleeping.
+ *
+ * The slot at position pos is ready for a producer once its sequence number is pos, and for a consumer once it is
+ * pos + 1. A sleeping stage registers itself and checks the slot again under the mutex before waiting, and stages
+ * that make a slot ready only take the mutex to wake it when one is registered, so no wakeup is lost.
+ *
+ * @param buffer A pointer to the Buffer backed by the queue.
+ * @param pos A pointer to the position claimed next, enqueuePos or dequeuePos.
+ * @param ahead 0 when waiting for a free slot, or 1 when waiting for a line.
+ * @param cond The condition variable signalled when the slot becomes ready.
+ * @param sleeping A pointer to the number of stages sleeping on cond.
+ * @return 0 once the slot may be ready, or -1 if the pipeline was cancelled.
+ */
+int mpmcWait(Buffer* buffer, size_t* pos, size_t ahead, pthread_cond_t* cond, int* sleeping) {
+	for (int spins = 0;; spins++) {
+		const size_t at = __atomic_load_n(pos, __ATOMIC_RELAXED);
+		const size_t seq = __atomic_load_n(&buffer->slots[at & buffer->mask].seq, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&buffer->cancelled, __ATOMIC_RELAXED))
+			return -1;
+		if ((intptr_t) (seq - (at + ahead)) >= 0)
+			return 0;
+
+		// Yield between coroutines, and spin, then yield the processor, before sleeping between threads
+		if (currentCoroutine)
+			coroutineYield();
+		else if (spins < opts.spins / 4)
+			cpuRelax();
+		else if (spins < opts.spins)
+			sched_yield();
+		else {
+			pthread_mutex_lock(&buffer->mutex);
+			__atomic_add_fetch(sleeping, 1, __ATOMIC_SEQ_CST);
+			const size_t again = __atomic_load_n(pos, __ATOMIC_SEQ_CST);
+			const size_t ready = __atomic_load_n(&buffer->slots[again & buffer->mask].seq, __ATOMIC_SEQ_CST);
+			if ((intptr_t) (ready - (again + ahead)) < 0 && !buffer->cancelled)
+				pthread_cond_wait(cond, &buffer->mutex);
+			__atomic_sub_fetch(sleeping, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&buffer->mutex);
+			spins = 0;
+		}
+	}
+}
+
+/**
+ * @brief Wakes the stages sleeping on a condition variable of a queue backed buffer, if any.
+ *
+ * @param buffer A pointer to the Buffer backed by the queue.
+ * @param cond The condition variable to broadcast.
+ * @param sleeping A pointer to the number of stages sleeping on cond.
+ */
+void mpmcWake(Buffer* buffer, pthread_cond_t* cond, int* sleeping) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(sleeping, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&buffer->mutex);
+		pthread_cond_broadcast(cond);
+		pthread_mutex_unlock(&buffer->mutex);
+	}
+}
+
+/**
+ * @brief Stores a line in a queue backed buffer.
+ *
+ * The producer claims the position of a free slot by advancing enqueuePos with a compare and swap, copies the line to
+ * the slot, and publishes it to the consumer of that position by advancing the slot's sequence number.
+ *
+ * @param buffer A pointer to the Buffer backed by the queue.
+ * @param input A pointer to the Line to store.
+ * @return 0 if the line was stored, or -1 if the pipeline was cancelled.
+ */
+int mpmcPut(Buffer* buffer, Line* input) {
+	MpmcSlot* slot;
+	size_t pos = __atomic_load_n(&buffer->enqueuePos, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &buffer->slots[pos & buffer->mask];
+		const intptr_t diff = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos;
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&buffer->enqueuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			// Wait for the consumer of the previous round to free the slot
+			if (mpmcWait(buffer, &buffer->enqueuePos, 0, &buffer->empty, &buffer->sleepingProducers))
+				return -1;
+			pos = __atomic_load_n(&buffer->enqueuePos, __ATOMIC_RELAXED);
+		} else
+			pos = __atomic_load_n(&buffer->enqueuePos, __ATOMIC_RELAXED);
+	}
+
+	// Copy input to the slot and publish it
+	slot->len = strlen(input->text);
+	slot->cached = input->cached;
+	slot->stop = input->stop;
+	slot->key = input->key;
+	memcpy(slot->text, input->text, slot->len);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	mpmcWake(buffer, &buffer->full, &buffer->sleepingConsumers);
+
+	// Track the peak use, which may lag behind under contention
+	const size_t count = pos + 1 - __atomic_load_n(&buffer->dequeuePos, __ATOMIC_RELAXED);
+	if (count <= buffer->mask + 1 && (int) count > __atomic_load_n(&buffer->peakCount, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&buffer->peakCount, count, __ATOMIC_RELAXED);
+		__atomic_store_n(&buffer->peak, count * sizeof(MpmcSlot), __ATOMIC_RELAXED);
+	}
+	if (currentCoroutine)
+		coroutineProgress++;
+	return 0;
+}
+
+/**
+ * @brief Retrieves a line from a queue backed buffer.
+ *
+ * The consumer claims the position of a stored line by advancing dequeuePos with a compare and swap, copies the line
+ * out of the slot, and frees the slot for the producer of the next round by advancing its sequence number.
+ *
+ * @param buffer A pointer to the Buffer backed by the queue.
+ * @param output A pointer to the Line that will store the retrieved line.
+ * @return 0 if a line was retrieved, or -1 if the pipeline was cancelled.
+ */
+int mpmcGet(Buffer* buffer, Line* output) {
+	MpmcSlot* slot;
+	size_t pos = __atomic_load_n(&buffer->dequeuePos, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &buffer->slots[pos & buffer->mask];
+		const intptr_t diff = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1);
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&buffer->dequeuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			// Wait for the producer of this round to store the line
+			if (mpmcWait(buffer, &buffer->dequeuePos, 1, &buffer->full, &buffer->sleepingConsumers))
+				return -1;
+			pos = __atomic_load_n(&buffer->dequeuePos, __ATOMIC_RELAXED);
+		} else
+			pos = __atomic_load_n(&buffer->dequeuePos, __ATOMIC_RELAXED);
 	}
+
+	// Copy the slot to output and free it
+	memcpy(output->text, slot->text, slot->len);
+	output->text[slot->len] = '\0';
+	output->cached = slot->cached;
+	output->stop = slot->stop;
+	output->key = slot->key;
+	__atomic_store_n(&slot->seq, pos + buffer->mask + 1, __ATOMIC_RELEASE);
+	mpmcWake(buffer, &buffer->empty, &buffer->sleepingProducers);
+	if (currentCoroutine)
+		coroutineProgress++;
 	return 0;
 }
+
+/**
+ * @brief Checks whether a buffer has no line available for consumption by a branch.
+ *
+ * @param buffer A pointer to the Buffer to check.
+ * @param branch The index of the branch consuming the buffer.
+ * @return 1 if the buffer is empty, or 0 otherwise.
+ */
+int bufferEmpty(Buffer* buffer, int branch) {
+	if (buffer->slots) {
+		const size_t pos = __atomic_load_n(&buffer->dequeuePos, __ATOMIC_RELAXED);
+		return pos == __atomic_load_n(&buffer->enqueuePos, __ATOMIC_RELAXED);
+	}
+	if (currentCoroutine)
+		return !buffer->unread[branch];
+	pthread_mutex_lock(&buffer->mutex);
+	const int empty = !buffer->unread[branch];
+	pthread_mutex_unlock(&buffer->mutex);
+	return empty;
+}
+
+/**
+ * @brief Retrieves a line of text from the specified buffer and stores it in the output line.
+ *
+ * The getBuff function locks the buffer's mutex, then waits for the branch to have a line available for consumption.
+ * Once a line is available, the function skips any wrap gap, copies the record at the branch's offset to the output
+ * line, and moves the branch past it. Once the last branch has read a record, the record is freed, updating the
+ * buffer's count and bytes in use. The function then signals that space may be free, waking every producer if the
+ * buffer has several, and unlocks the mutex. Once the ring is empty, lines are taken from the spill file. In coroutine
+ * mode, the function yields to the other coroutines instead of waiting, and takes no locks. A buffer backed by the
+ * queue is read by mpmcGet instead.
+ *
+ * @param buffer A pointer to the Buffer structure from which a line of text will be retrieved.
+ * @param branch The index of the branch consuming the buffer, 0 unless the buffer feeds several branches.
+ * @param output A pointer to the Line that will store the retrieved line of text.
+ * @return 0 if a line was retrieved, or -1 if the pipeline was cancelled.
+ */
+int getBuff(Buffer* buffer, int branch, Line* output) {
+	if (buffer->slots)
+		return mpmcGet(buffer, output);
+
+	// Yield until a line is unread between coroutines
+	if (currentCoroutine) {
+		while (!buffer->unread[branch] && !buffer->cancelled)
+			coroutineYield();
+	}
+
+	// Lock mutex and wait until a line is unread between threads
+	else {
+		pthread_mutex_lock(&buffer->mutex);
+		while (!buffer->unread[branch] && !buffer->cancelled)
+			pthread_cond_wait(&buffer->full, &buffer->mutex);
+	}
+
+	// Give up when cancelled
+	if (buffer->cancelled) {
+		if (!currentCoroutine)
+			pthread_mutex_unlock(&buffer->mutex);
+		return -1;
+	}
+
+	// Take the line from the spill file once the ring is empty, reading it without the mutex
+	if (buffer->unread[branch] == buffer->spilled) {
+		const off_t offset = buffer->spillRead;
+		if (!currentCoroutine)
+			pthread_mutex_unlock(&buffer->mutex);
+		const size_t size = bufferUnspill(buffer, offset, output);
+		if (!currentCoroutine)
+			pthread_mutex_lock(&buffer->mutex);
+
+		// Free its space, restarting at the start of the file once everything written was read
+		buffer->spillRead += size;
+		if (buffer->spillRead == buffer->spillWrite)
+			buffer->spillRead = buffer->spillWrite = 0;
+		buffer->spilled--;
+		buffer->count--;
+	} else {
+		// Continue at the start of the ring after a wrap gap
+		size_t iRead = buffer->iRead[branch];
+		Record* rec = (Record*) (buffer->buff + iRead);
+		if (buffer->size - iRead < sizeof(Record) || rec->len == RECORD_WRAP) {
+			iRead = 0;
+			rec = (Record*) buffer->buff;
+		}
+
+		// Copy record to output
+		recordRead(rec, output);
+		buffer->iRead[branch] = iRead + recordSize(rec->len + rec->rawLen);
+		rec->refs--;
+
+		// Free the records every branch has read
+		while (buffer->count > buffer->spilled) {
+			rec = (Record*) (buffer->buff + buffer->iCon);
+			if (buffer->size - buffer->iCon < sizeof(Record) || rec->len == RECORD_WRAP) {
+				// Move branches waiting at the gap to the start, as the producer may reuse the gap
+				for (int i = 0; i < buffer->branches; i++)
+					if (buffer->iRead[i] == buffer->iCon)
+						buffer->iRead[i] = 0;
+				buffer->used -= buffer->size - buffer->iCon;
+				buffer->iCon = 0;
+				continue;
+			}
+			if (rec->refs)
+				break;
+			const size_t size = recordSize(rec->len + rec->rawLen);
+			buffer->iCon += size;
+			buffer->used -= size;
+			buffer->count--;
+		}
+	}
+
+	// Decrement vars, restart an empty ring at its start so the next records need not wrap, and unlock mutex
+	buffer->unread[branch]--;
+	if (currentCoroutine)
+		coroutineProgress++;
+	if (buffer->count == buffer->spilled) {
+		buffer->iCon = buffer->iProd = buffer->used = 0;
+		memset(buffer->iRead, 0, sizeof(buffer->iRead));
+	}
+	if (!currentCoroutine) {
+		if (buffer->producers > 1)
+			pthread_cond_broadcast(&buffer->empty);
+		else
+			pthread_cond_signal(&buffer->empty);
+		pthread_mutex_unlock(&buffer->mutex);
+	}
+	return 0;
+}
+
+/**
+ * @brief Replaces all occurrences of a specified substring within a string with a single replacement character.
+ *
+ * The replaceSubstring function searches for all occurrences of the specified 'remove' substring within the input
+ * 'str'. When a match is found, the function replaces the substring with the 'replace' character and moves the
+ * remaining characters in the string to fill the gap left by the removed substring. The process is repeated until
+ * no more occurrences of the substring are found.
+ *
+ * @param str A pointer to the input string in which the specified substring will be replaced.
+ * @param remove A pointer to the substring that will be replaced within the input string.
+ * @param replace The replacement character that will be used to replace the specified substring.
+ */
+void replaceSubstring(char* str, const char* remove, char replace) {
+	const size_t remove_len = strlen(remove);
+	
+	// Replace remove with reaplce until str does not contain remove
+	while ((str = strstr(str, remove))) {
+		*str = replace;
+		memmove(str + 1, str + remove_len, strlen(str + remove_len) + 1);
+	}
+}
+
+/**
+ * @brief Stores a line of text in the specified buffer.
+ *
+ * The putBuff function locks the buffer's mutex and waits until the buffer has room for the line's record, then
+ * writes the record at the buffer's producer offset, first leaving a wrap gap if the record does not fit before the
+ * end of the ring. It increments the buffer's count, bytes in use and the unread lines of every branch, and signals
+ * that the buffer is not empty using the buffer's full condition variable, waking every branch if the buffer feeds
+ * several. Finally, the function unlocks the buffer's mutex. While the ring is full or the spill file holds lines, the
+ * record is appended to the spill file instead. In coroutine mode, the function yields to the other coroutines instead
+ * of waiting, and takes no locks. A buffer backed by the queue is written by mpmcPut instead.
+ *
+ * @param buffer A pointer to the Buffer structure where the input line of text will be stored.
+ * @param input A pointer to the Line containing the line of text to be stored in the buffer.
+ * @return 0 if the line was stored, or -1 if the pipeline was cancelled.
+ */
+int putBuff(Buffer* buffer, Line* input) {
+	if (buffer->slots)
+		return mpmcPut(buffer, input);
+
+	const size_t len = strlen(input->text), size = recordSize(len + input->rawLen);
+
+	// Yield until the record fits between coroutines
+	int room;
+	if (currentCoroutine) {
+		while (!(room = bufferRoom(buffer, size)) && !buffer->cancelled)
+			coroutineYield();
+	}
+
+	// Lock mutex and wait until the record fits between threads
+	else {
+		pthread_mutex_lock(&buffer->mutex);
+		while (!(room = bufferRoom(buffer, size)) && !buffer->cancelled)
+			pthread_cond_wait(&buffer->empty, &buffer->mutex);
+	}
+
+	// Give up when cancelled
+	if (buffer->cancelled) {
+		if (!currentCoroutine)
+			pthread_mutex_unlock(&buffer->mutex);
+		return -1;
+	}
+
+	// Append to the spill file, keeping the ring for older records, and write it without the mutex
+	if (room == 2) {
+		const off_t offset = buffer->spillWrite;
+		buffer->spillWrite += size;
+		if (!currentCoroutine)
+			pthread_mutex_unlock(&buffer->mutex);
+		bufferSpill(buffer, offset, input, len);
+		if (!currentCoroutine)
+			pthread_mutex_lock(&buffer->mutex);
+		buffer->spilled++;
+	} else {
+		// Leave a wrap gap if the record does not fit before the end
+		if (buffer->iProd + size > buffer->size) {
+			if (buffer->size - buffer->iProd >= sizeof(Record))
+				((Record*) (buffer->buff + buffer->iProd))->len = RECORD_WRAP;
+			buffer->used += buffer->size - buffer->iProd;
+			buffer->iProd = 0;
+		}
+
+		// Copy input to a record
+		Record* rec = (Record*) (buffer->buff + buffer->iProd);
+		recordWrite(rec, input, len);
+		rec->refs = buffer->branches;
+		buffer->iProd += size;
+		buffer->used += size;
+		if (buffer->used > buffer->peak)
+			buffer->peak = buffer->used;
+	}
+
+	// Increment vars
+	if (++buffer->count > buffer->peakCount)
+		buffer->peakCount = buffer->count;
+	for (int i = 0; i < buffer->branches; i++)
+		buffer->unread[i]++;
+	if (currentCoroutine)
+		coroutineProgress++;
+	
+	// Signal buffer full, waking every branch, and unlock
+	if (!currentCoroutine) {
+		if (buffer->branches > 1)
+			pthread_cond_broadcast(&buffer->full);
+		else
+			pthread_cond_signal(&buffer->full);
+		pthread_mutex_unlock(&buffer->mutex);
+	}
+	return 0;
+}
+
+/**
+ * @struct ClosedFile
+ * @brief A structure describing an output file waiting for the finalizer thread.
+ *
+ * @var ClosedFile::next
+ * A pointer to the next file in the finalizer queue.
+ * @var ClosedFile::fd
+ * The file descriptor of the file, still open so it can be synced.
+ * @var ClosedFile::path
+ * The path of the file.
+ * @var ClosedFile::start
+ * The offset of the first byte of the file in the whole output.
+ * @var ClosedFile::end
+ * The offset just past the last byte of the file in the whole output.
+ */
+typedef struct ClosedFile {
+	struct ClosedFile* next;
+	int fd;
+	char path[PATH_MAX];
+	unsigned long long start, end;
+} ClosedFile;
+
+/**
+ * @struct OutputFiles
+ * @brief A structure representing output written to one or more rotated files instead of stdout.
+ *
+ * Output is staged in a page aligned buffer and written to the current file in full STAGING_SIZE blocks, so every
+ * write but the last of a file is large and aligned. Space is preallocated PREALLOC_SIZE bytes at a time to keep the
+ * file in few extents, and trimmed back to the written size when the file is closed. Every WRITEBACK_SIZE bytes,
+ * writeback of the new data is started and the previous window is waited for and dropped from the page cache, which
+ * keeps the amount of dirty data, and with it the write throughput, flat.
+ *
+ * In direct mode files are opened with O_DIRECT, so the aligned blocks go straight to the device without passing
+ * through the page cache. Only the unaligned tail of each file is written through the page cache, held in the staging
+ * buffer until the file is closed, and dropped from the page cache by the finalizer thread.
+ *
+ * When rotation is enabled, a new file is started whenever the next line would exceed the byte or line limit, so files
+ * always end on a line boundary. Closed files are handed to a finalizer thread that syncs, optionally compresses and
+ * records them in the manifest, so rotation never waits for the disk.
+ *
+ * @var OutputFiles::base
+ * The output path given on the command line.
+ * @var OutputFiles::path
+ * The path of the current file.
+ * @var OutputFiles::fd
+ * The file descriptor of the current file.
+ * @var OutputFiles::index
+ * The number of the current file, used in rotated file names.
+ * @var OutputFiles::regular
+ * A flag set when the current file is a regular file, enabling preallocation and writeback hints.
+ * @var OutputFiles::direct
+ * A flag set when the current file was opened with O_DIRECT.
+ * @var OutputFiles::allocated
+ * The number of bytes preallocated in the current file.
+ * @var OutputFiles::submitted
+ * The offset in the current file up to which writeback has been started.
+ * @var OutputFiles::synced
+ * The offset in the current file up to which data has been written back and dropped from the page cache.
+ * @var OutputFiles::staging
+ * A buffer of STAGING_SIZE bytes holding output not yet written to the current file.
+ * @var OutputFiles::staged
+ * The number of bytes in the staging buffer.
+ * @var OutputFiles::fileStart
+ * The offset of the first byte of the current file in the whole output.
+ * @var OutputFiles::total
+ * The number of bytes output so far.
+ * @var OutputFiles::fileLines
+ * The number of lines in the current file.
+ * @var OutputFiles::finalizer
+ * The thread that finalizes closed files.
+ * @var OutputFiles::mutex
+ * A mutex used to synchronize access to the finalizer queue.
+ * @var OutputFiles::queued
+ * A condition variable used to signal that a file was added to the finalizer queue.
+ * @var OutputFiles::head
+ * The oldest file in the finalizer queue.
+ * @var OutputFiles::tail
+ * The newest file in the finalizer queue.
+ * @var OutputFiles::done
+ * A flag set once the last file has been queued.
+ * @var OutputFiles::manifest
+ * The manifest listing each finalized file with its byte range, or NULL when not rotating.
+ */
+typedef struct {
+	const char* base;
+	char path[PATH_MAX];
+	int fd, index, regular, direct;
+	off_t allocated, submitted, synced;
+	char* staging;
+	size_t staged;
+	unsigned long long fileStart, total, fileLines;
+	pthread_t finalizer;
+	pthread_mutex_t mutex;
+	pthread_cond_t queued;
+	ClosedFile *head, *tail;
+	int done;
+	FILE* manifest;
+} OutputFiles;
+
+OutputFiles outputFiles = {.fd = -1};
+
+/**
+ * @brief Finalizes closed output files in the order they were closed.
+ *
+ * The finalizeThread function waits for files on the finalizer queue. Each file is synced to disk, dropped from the
+ * page cache and closed, then optionally compressed with gzip, and finally recorded in the manifest with the byte range
+ * of the whole output it holds. The thread returns once the last file has been finalized.
+ *
+ * @param args A pointer to the OutputFiles whose files are finalized.
+ * @return NULL The function returns NULL as it is intended to be used with pthread_create.
+ */
+void* finalizeThread(void* args) {
+	OutputFiles* out = (OutputFiles*) args;
+	for (;;) {
+		// Wait for the next closed file
+		pthread_mutex_lock(&out->mutex);
+		while (!out->head && !out->done)
+			pthread_cond_wait(&out->queued, &out->mutex);
+		ClosedFile* file = out->head;
+		if (file && !(out->head = file->next))
+			out->tail = NULL;
+		pthread_mutex_unlock(&out->mutex);
+		if (!file)
+			return NULL;
+
+		// Sync, uncache and close the file
+		if (fsync(file->fd))
+			fprintf(stderr, "output: cannot sync %s: %s\n", file->path, strerror(errno));
+		posix_fadvise(file->fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(file->fd);
+
+		// Optionally compress the file
+		if (opts.compress) {
+			pid_t pid = fork();
+			if (!pid) {
+				signal(SIGPIPE, SIG_DFL);
+				execlp("gzip", "gzip", "-f", file->path, (char*) NULL);
+				_exit(127);
+			}
+			int status;
+			if (pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && !WEXITSTATUS(status))
+				strcat(file->path, ".gz");
+			else
+				fprintf(stderr, "output: cannot compress %s\n", file->path);
+		}
+
+		// Record the file in the manifest
+		if (out->manifest) {
+			fprintf(out->manifest, "%s %llu %llu\n", file->path, file->start, file->end);
+			fflush(out->manifest);
+		}
+		free(file);
+	}
+}
+
+/**
+ * @brief Opens the next output file.
+ *
+ * @param out A pointer to the OutputFiles to open the next file of.
+ */
+void outputFilesOpen(OutputFiles* out) {
+	// Number files when rotating
+	if (opts.rotateBytes || opts.rotateLines)
+		snprintf(out->path, sizeof(out->path), "%s.%04d", out->base, out->index++);
+	else
+		snprintf(out->path, sizeof(out->path), "%s", out->base);
+
+	// Open the file, falling back to the page cache if the file system does not support O_DIRECT
+	const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	out->direct = opts.direct;
+	out->fd = open(out->path, flags | (out->direct ? O_DIRECT : 0), 0644);
+	if (out->fd < 0 && out->direct && errno == EINVAL) {
+		fprintf(stderr, "output: %s does not support O_DIRECT, using buffered writes\n", out->path);
+		out->direct = 0;
+		out->fd = open(out->path, flags, 0644);
+	}
+	if (out->fd < 0) {
+		fprintf(stderr, "output: cannot open %s: %s\n", out->path, strerror(errno));
+		exit(1);
+	}
+	out->fileStart = out->total;
+	out->fileLines = 0;
+
+	// Hint sequential access to regular files
+	struct stat st;
+	out->regular = !fstat(out->fd, &st) && S_ISREG(st.st_mode);
+	out->allocated = out->submitted = out->synced = 0;
+	if (out->regular)
+		posix_fadvise(out->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+/**
+ * @brief Writes data to the current output file, retrying short and interrupted writes.
+ *
+ * @param out A pointer to the OutputFiles to write to.
+ * @param data The data to write.
+ * @param len The number of bytes of data.
+ */
+void outputFilesWriteAll(OutputFiles* out, const char* data, size_t len) {
+	for (size_t done = 0; done < len;) {
+		ssize_t n = write(out->fd, data + done, len - done);
+		if (n < 0 && errno != EINTR) {
+			fprintf(stderr, "output: cannot write %s: %s\n", out->path, strerror(errno));
+			exit(1);
+		}
+		done += n > 0 ? n : 0;
+	}
+}
+
+/**
+ * @brief Writes the staged output to the current output file.
+ *
+ * The outputFilesFlush function extends the preallocated space of the file if the staged data would not fit, writes
+ * the staged data, and manages writeback of the file in WRITEBACK_SIZE windows. In direct mode an unaligned tail stays
+ * staged until the file is closed, when it is written with O_DIRECT turned off for that one write.
+ *
+ * @param out A pointer to the OutputFiles to flush.
+ * @param last A flag set when the file is about to be closed.
+ */
+void outputFilesFlush(OutputFiles* out, int last) {
+	const off_t end = out->total - out->fileStart;
+
+	// Preallocate ahead of the data, giving up if the file system cannot
+	while (out->regular && out->allocated < end) {
+		if (fallocate(out->fd, FALLOC_FL_KEEP_SIZE, out->allocated, PREALLOC_SIZE)) {
+			out->allocated = LLONG_MAX;
+			break;
+		}
+		out->allocated += PREALLOC_SIZE;
+	}
+
+	// Write the staged data, only in aligned blocks with O_DIRECT
+	const size_t aligned = out->direct ? out->staged / DIRECT_ALIGN * DIRECT_ALIGN : out->staged;
+	outputFilesWriteAll(out, out->staging, aligned);
+
+	// O_DIRECT only takes aligned sizes, so write the unaligned tail of the file through the page cache
+	if (last && aligned < out->staged) {
+		const int flags = fcntl(out->fd, F_GETFL);
+		fcntl(out->fd, F_SETFL, flags & ~O_DIRECT);
+		outputFilesWriteAll(out, out->staging + aligned, out->staged - aligned);
+		fcntl(out->fd, F_SETFL, flags);
+		out->staged = aligned;
+	}
+
+	// Keep an unaligned tail staged for the next flush
+	memmove(out->staging, out->staging + aligned, out->staged - aligned);
+	out->staged -= aligned;
+
+	// Finish the previous writeback window and drop it from the page cache, then start writeback of the new one
+	if (out->regular && !out->direct && end - out->submitted >= WRITEBACK_SIZE) {
+		if (out->submitted > out->synced) {
+			sync_file_range(out->fd, out->synced, out->submitted - out->synced,
+					SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(out->fd, out->synced, out->submitted - out->synced, POSIX_FADV_DONTNEED);
+			out->synced = out->submitted;
+		}
+		sync_file_range(out->fd, out->submitted, end - out->submitted, SYNC_FILE_RANGE_WRITE);
+		out->submitted = end;
+	}
+}
+
+/**
+ * @brief Flushes and closes the current output file and hands it to the finalizer thread.
+ *
+ * @param out A pointer to the OutputFiles whose current file is closed.
+ */
+void outputFilesClose(OutputFiles* out) {
+	outputFilesFlush(out, 1);
+
+	// Release the preallocated space past the end of the data
+	if (out->regular && out->allocated)
+		ftruncate(out->fd, out->total - out->fileStart);
+
+	// Queue the file for the finalizer
+	ClosedFile* file = malloc(sizeof(ClosedFile));
+	file->next = NULL;
+	file->fd = out->fd;
+	strcpy(file->path, out->path);
+	file->start = out->fileStart;
+	file->end = out->total;
+	pthread_mutex_lock(&out->mutex);
+	if (out->tail)
+		out->tail->next = file;
+	else
+		out->head = file;
+	out->tail = file;
+	pthread_cond_signal(&out->queued);
+	pthread_mutex_unlock(&out->mutex);
+	out->fd = -1;
+}
+
+/**
+ * @brief Starts writing output to files, and starts the finalizer thread.
+ *
+ * @param out A pointer to the OutputFiles to initialize.
+ * @param base The output path given on the command line.
+ */
+void outputFilesInit(OutputFiles* out, const char* base) {
+	out->base = base;
+	if (posix_memalign((void**) &out->staging, DIRECT_ALIGN, STAGING_SIZE)) {
+		fprintf(stderr, "output: out of memory\n");
+		exit(1);
+	}
+
+	// Write a manifest when rotating
+	if (opts.rotateBytes || opts.rotateLines) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s.manifest", base);
+		if (!(out->manifest = fopen(path, "w"))) {
+			fprintf(stderr, "output: cannot open %s: %s\n", path, strerror(errno));
+			exit(1);
+		}
+	}
+	pthread_mutex_init(&out->mutex, NULL);
+	pthread_cond_init(&out->queued, NULL);
+	pthread_create(&out->finalizer, NULL, finalizeThread, out);
+	outputFilesOpen(out);
+}
+
+/**
+ * @brief Writes one line of output, rotating to a new file first if the line would exceed a rotation limit.
+ *
+ * @param out A pointer to the OutputFiles to write to.
+ * @param line A pointer to the line to write, including its line separator.
+ * @param len The number of characters in the line.
+ */
+void outputFilesWrite(OutputFiles* out, const char* line, size_t len) {
+	// Rotate on the line boundary before the limit
+	const unsigned long long fileBytes = out->total - out->fileStart;
+	if ((opts.rotateBytes && fileBytes && fileBytes + len > opts.rotateBytes)
+			|| (opts.rotateLines && out->fileLines == opts.rotateLines)) {
+		outputFilesClose(out);
+		outputFilesOpen(out);
+	}
+
+	// Stage the line, writing the staging buffer whenever it is exactly full
+	out->fileLines++;
+	while (len) {
+		const size_t n = len < STAGING_SIZE - out->staged ? len : STAGING_SIZE - out->staged;
+		memcpy(out->staging + out->staged, line, n);
+		out->staged += n;
+		out->total += n;
+		line += n;
+		len -= n;
+		if (out->staged == STAGING_SIZE)
+			outputFilesFlush(out, 0);
+	}
+
+	// Make each line visible right away in follow mode
+	if (opts.follow)
+		outputFilesFlush(out, 0);
+}
+
+/**
+ * @brief Closes the last output file and waits for the finalizer thread to finish.
+ *
+ * @param out A pointer to the OutputFiles to shut down.
+ */
+void outputFilesDestroy(OutputFiles* out) {
+	outputFilesClose(out);
+	pthread_mutex_lock(&out->mutex);
+	out->done = 1;
+	pthread_cond_signal(&out->queued);
+	pthread_mutex_unlock(&out->mutex);
+	pthread_join(out->finalizer, NULL);
+
+	if (out->manifest)
+		fclose(out->manifest);
+	pthread_mutex_destroy(&out->mutex);
+	pthread_cond_destroy(&out->queued);
+	free(out->staging);
+}
+
+/**
+ * @struct ResultCache
+ * @brief A structure describing the entry of the whole-input result cache for the current input.
+ *
+ * @var ResultCache::path
+ * The path of the cached output for the current input and rules.
+ * @var ResultCache::tmpPath
+ * The path the output is recorded to before it is renamed into place.
+ * @var ResultCache::file
+ * The file the output is being recorded to, or NULL if no output is being recorded.
+ */
+typedef struct {
+	char path[PATH_MAX];
+	char tmpPath[PATH_MAX + 32];
+	FILE* file;
+} ResultCache;
+
+ResultCache resultCache;
+
+/**
+ * @brief Writes one formatted line of PRINT_SIZE characters followed by a line separator.
+ *
+ * The emitLine function prints the line to stdout, or writes it to the output files if an output path was given, or
+ * buffers it for the pipeline's output file descriptor in event loop and server mode or when stdout is a pipe. While
+ * the output is being recorded for the result cache, it also appends the line to the cache file. If the reader of the
+ * output has gone away, the pipeline is cancelled.
+ *
+ * @param p A pointer to the Pipeline the line is output by.
+ * @param line A pointer to at least PRINT_SIZE characters to write.
+ */
+void emitLine(Pipeline* p, const char* line) {
+	char buff[PRINT_SIZE + 1];
+	memcpy(buff, line, PRINT_SIZE);
+	buff[PRINT_SIZE] = '\n';
+	if (outputFiles.fd >= 0)
+		outputFilesWrite(&outputFiles, buff, sizeof(buff));
+	else if (p->out.buff)
+		pipelineWrite(p, buff, sizeof(buff));
+	else if (printf("%.*s\n", PRINT_SIZE, line) < 0 && errno == EPIPE)
+		cancelPipeline(p);
+	if (resultCache.file) {
+		fwrite(line, 1, PRINT_SIZE, resultCache.file);
+		fputc('\n', resultCache.file);
+	}
+}
+
+/**
+ * @brief Formats and prints the input text with a fixed width of PRINT_SIZE characters per line.
+ *
+ * The printOutput function appends the input text to the pipeline's pending output. It then checks if the length of
+ * the pending output is greater than or equal to PRINT_SIZE. If so, the function prints the first PRINT_SIZE
+ * characters as a line, and shifts the remaining characters to the beginning. This process is repeated until the
+ * length of the pending output is less than PRINT_SIZE.
+ *
+ * @param p A pointer to the Pipeline the text is output by.
+ * @param input A pointer to the input text that will be formatted and printed with fixed width.
+ */
+void printOutput(Pipeline* p, char* input) {
+	// Concatinate pending output with input
+	char* output = p->pending;
+	strcat(output, input);
+	
+	// Loop over output, printing 80 chars at a time
+	while (strlen(output) >= PRINT_SIZE) {
+		emitLine(p, output);
+		memmove(output, output + PRINT_SIZE, strlen(output + PRINT_SIZE) + 1);
+	}
+}
+
+/**
+ * @struct TeeOutput
+ * @brief A structure holding the output file of a tee branch, which formats lines to its own width.
+ *
+ * @var TeeOutput::file
+ * The file the branch writes its output lines to.
+ * @var TeeOutput::width
+ * The number of characters per output line.
+ * @var TeeOutput::pending
+ * The LINE_SIZE + width bytes holding characters not yet formed into a full line.
+ * @var TeeOutput::len
+ * The number of pending characters.
+ */
+typedef struct TeeOutput {
+	FILE* file;
+	size_t width;
+	char* pending;
+	size_t len;
+} TeeOutput;
+
+/**
+ * @brief Opens the output file of a tee branch.
+ *
+ * @param tee A pointer to the TeeOutput to initialize.
+ * @param path The path of the output file.
+ * @param width The number of characters per output line.
+ * @return 0 on success, or -1 if the file could not be created.
+ */
+int teeInit(TeeOutput* tee, const char* path, size_t width) {
+	tee->width = width;
+	tee->len = 0;
+	if (!(tee->pending = malloc(LINE_SIZE + width)))
+		return -1;
+	if (!(tee->file = fopen(path, "w"))) {
+		free(tee->pending);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Formats the input text to the tee branch's output with a fixed width per line, like printOutput.
+ *
+ * @param tee A pointer to the TeeOutput to write to.
+ * @param input A pointer to the input text.
+ */
+void teeOutput(TeeOutput* tee, const char* input) {
+	const size_t len = strlen(input);
+	memcpy(tee->pending + tee->len, input, len);
+	tee->len += len;
+
+	// Write whole lines and keep the rest
+	size_t done = 0;
+	for (; tee->len - done >= tee->width; done += tee->width) {
+		fwrite(tee->pending + done, 1, tee->width, tee->file);
+		fputc('\n', tee->file);
+	}
+	memmove(tee->pending, tee->pending + done, tee->len - done);
+	tee->len -= done;
+}
+
+/**
+ * @brief Closes the output file of a tee branch.
+ *
+ * @param tee A pointer to the TeeOutput to close.
+ */
+void teeDestroy(TeeOutput* tee) {
+	if (fclose(tee->file))
+		fprintf(stderr, "tee: cannot write output: %s\n", strerror(errno));
+	free(tee->pending);
+}
+
+/**
+ * @brief Adds a tee branch to a pipeline, formatting the output of the separator stage without the plus sign rule.
+ *
+ * The buffer after the separator stage then feeds two branches: the plus sign stage followed by the output stage, and
+ * a second output stage writing to the tee. Each line is read and separated once and stored once for both branches.
+ *
+ * @param p A pointer to the Pipeline to add the branch to.
+ * @param tee A pointer to the TeeOutput the branch writes to.
+ */
+void pipelineTee(Pipeline* p, TeeOutput* tee) {
+	ThreadArgs* args = &p->args[p->nStages++];
+	*args = stageArgs[NUM_THREADS - 1];
+	args->iBuffer = 2;
+	args->branch = 1;
+	args->tee = tee;
+	args->pipeline = p;
+	p->buffers[1].branches = 2;
+}
+
+/**
+ * @brief Makes a pipeline merge several input files instead of reading stdin, each read by its own input stage.
+ *
+ * The input stages run in parallel and all produce into the first buffer, so a slow source does not hold up the
+ * others. Lines are interleaved in the order they are read, or, when merging in source order, the lines of each source
+ * are passed on only once every earlier source has ended; until then a source reads ahead into its own buffer.
+ *
+ * @param p A pointer to the Pipeline to merge the sources into.
+ * @param sources The sources, with their paths set.
+ * @param n The number of sources, at most MAX_SOURCES.
+ * @param order 1 to merge in source order, or 0 to interleave by arrival.
+ * @param queueBytes The capacity in bytes of the buffer each source reads ahead into.
+ * @return 0 on success, or -1 if the buffers could not be allocated.
+ */
+int pipelineMerge(Pipeline* p, Source* sources, int n, int order, size_t queueBytes) {
+	for (int i = 0; i < n; i++) {
+		sources[i].file = NULL;
+		sources[i].index = i;
+		if (order && bufferInit(&sources[i].ahead, queueBytes, 0)) {
+			while (i--)
+				bufferDestroy(&sources[i].ahead);
+			return -1;
+		}
+	}
+	p->sources = sources;
+	p->nSources = n;
+	p->mergeOrder = order;
+	pthread_mutex_init(&p->mergeMutex, NULL);
+	pthread_cond_init(&p->mergeTurn, NULL);
+
+	// Give every source but the first an input stage of its own
+	p->args[0].source = &sources[0];
+	for (int i = 1; i < n; i++) {
+		ThreadArgs* args = &p->args[p->nStages++];
+		*args = p->args[0];
+		args->source = &sources[i];
+	}
+	p->buffers[0].producers = n;
+	return 0;
+}
+
+/**
+ * @brief Opens the input file of a merged source.
+ *
+ * @param source A pointer to the Source to open.
+ * @return The opened file, or NULL if it could not be opened, which ends the source.
+ */
+FILE* sourceOpen(Source* source) {
+	if (!(source->file = fopen(source->path, "r")))
+		fprintf(stderr, "input: cannot open %s: %s\n", source->path, strerror(errno));
+	return source->file;
+}
+
+/**
+ * @brief Waits until every source before the given one has ended.
+ *
+ * @param p A pointer to the Pipeline merging the source.
+ * @param source A pointer to the Source waiting for its turn.
+ * @return 0 once it is the source's turn, or -1 if the pipeline was cancelled.
+ */
+int sourceWait(Pipeline* p, Source* source) {
+	// Yield until it is the source's turn between coroutines
+	if (currentCoroutine) {
+		while (p->sourcesEnded < source->index && !isCancelled(p))
+			coroutineYield();
+	}
+
+	// Lock mutex and wait until it is the source's turn between threads
+	else {
+		pthread_mutex_lock(&p->mergeMutex);
+		while (p->sourcesEnded < source->index && !isCancelled(p))
+			pthread_cond_wait(&p->mergeTurn, &p->mergeMutex);
+		pthread_mutex_unlock(&p->mergeMutex);
+	}
+	return isCancelled(p) ? -1 : 0;
+}
+
+/**
+ * @brief Stores a line read from a merged source in the first buffer of the pipeline.
+ *
+ * When merging in source order, a line read before the source's turn is stored in the source's own buffer instead,
+ * and the source only waits for its turn once that buffer is full. The stop line ends the source, and is passed on to
+ * the next stage only by the last source to end.
+ *
+ * @param p A pointer to the Pipeline merging the source.
+ * @param tArgs A pointer to the ThreadArgs of the source's input stage.
+ * @param line A pointer to the Line to store.
+ * @return 0 if the line was stored, or -1 if the pipeline was cancelled.
+ */
+int sourcePut(Pipeline* p, ThreadArgs* tArgs, Line* line) {
+	Source* source = tArgs->source;
+	const int stop = line->stop;
+	if (p->mergeOrder) {
+		// Read ahead while it is not the source's turn and there is room
+		if (!stop && __atomic_load_n(&p->sourcesEnded, __ATOMIC_ACQUIRE) < source->index
+				&& bufferRoom(&source->ahead, recordSize(strlen(line->text))) == 1)
+			return putBuff(&source->ahead, line);
+
+		// Pass on the lines read ahead once it is
+		if (sourceWait(p, source))
+			return -1;
+		while (source->ahead.unread[0]) {
+			Line ahead;
+			if (getBuff(&source->ahead, 0, &ahead) || putBuff(&p->buffers[0], &ahead))
+				return -1;
+		}
+	}
+	if (!stop)
+		return putBuff(&p->buffers[0], line);
+
+	// End the source, and the input once every source has ended
+	if (!currentCoroutine)
+		pthread_mutex_lock(&p->mergeMutex);
+	const int last = ++p->sourcesEnded == p->nSources;
+	if (!currentCoroutine) {
+		pthread_cond_broadcast(&p->mergeTurn);
+		pthread_mutex_unlock(&p->mergeMutex);
+	}
+	return last ? putBuff(&p->buffers[0], line) : 0;
+}
+
+/**
+ * @struct SpanPipeline
+ * @brief A structure holding the state of the zero-copy span interface declared in line_processor.h.
+ *
+ * The span pipeline applies the rules of the four stages in a single pass over the caller's input: it splits the
+ * input into lines exactly as readLine does, turns each line separator into a space and each "++" into "^" as
+ * replaceSubstring does, and forms lines of PRINT_SIZE characters as printOutput does, stopping after the stop line.
+ * Output is written straight into staging memory made of slots of one output line each, so lines never wrap around
+ * the end of staging. The line being formed is built in place in its slot, and completed lines are handed to the
+ * caller without being copied. When every slot is waiting to be released, transforming stops in the middle of the
+ * current input span and resumes once the caller releases output.
+ *
+ * @var SpanPipeline::staging
+ * The staging memory of nSlots slots of PRINT_SIZE + 1 bytes.
+ * @var SpanPipeline::nSlots
+ * The number of slots.
+ * @var SpanPipeline::produced
+ * The number of output lines completed.
+ * @var SpanPipeline::delivered
+ * The number of output lines handed to the output callback.
+ * @var SpanPipeline::released
+ * The number of output lines released by the caller.
+ * @var SpanPipeline::col
+ * The number of characters of the output line being formed.
+ * @var SpanPipeline::head
+ * A pointer to the oldest queued input span.
+ * @var SpanPipeline::tail
+ * A pointer to the link the next submitted span is stored in.
+ * @var SpanPipeline::output
+ * The output callback.
+ * @var SpanPipeline::ack
+ * The acknowledge callback.
+ * @var SpanPipeline::ctx
+ * The argument passed to the callbacks.
+ * @var SpanPipeline::lineLen
+ * The number of characters of the current input line read so far.
+ * @var SpanPipeline::stopLen
+ * The number of leading characters of the current input line matching the stop line.
+ * @var SpanPipeline::plus
+ * A flag set when the last character of the current input line is a "+" that may start a "++".
+ * @var SpanPipeline::stopped
+ * A flag set once the stop line has been transformed.
+ * @var SpanPipeline::eof
+ * A flag set by spanPipelineFinish.
+ * @var SpanPipeline::stopQueued
+ * A flag set once stopLine has been queued.
+ * @var SpanPipeline::running
+ * A flag set while spanPipelineRun runs, so that releases from within the output callback do not run it again.
+ * @var SpanPipeline::stopLine
+ * The stop line the input thread reads at end of input, queued after the caller's input.
+ */
+struct SpanPipeline {
+	char* staging;
+	size_t nSlots;
+	unsigned long long produced, delivered, released;
+	size_t col;
+	SpanInput* head;
+	SpanInput** tail;
+	SpanOutputFn output;
+	SpanAckFn ack;
+	void* ctx;
+	size_t lineLen, stopLen;
+	int plus;
+	int stopped, eof, stopQueued, running;
+	SpanInput stopLine;
+};
+
+/**
+ * @brief Creates a span pipeline.
+ *
+ * @param stagingBytes The size of the staging memory, which must hold at least two output lines.
+ * @param output The callback receiving output.
+ * @param ack The callback receiving input spans that are no longer needed.
+ * @param ctx The argument passed to the callbacks.
+ * @return A pointer to the new SpanPipeline, or NULL if stagingBytes is too small or memory could not be allocated.
+ */
+SpanPipeline* spanPipelineCreate(size_t stagingBytes, SpanOutputFn output, SpanAckFn ack, void* ctx) {
+	SpanPipeline* sp = calloc(1, sizeof(*sp));
+	if (!sp)
+		return NULL;
+	sp->nSlots = stagingBytes / (PRINT_SIZE + 1);
+	if (sp->nSlots < 2 || !(sp->staging = malloc(sp->nSlots * (PRINT_SIZE + 1)))) {
+		free(sp);
+		return NULL;
+	}
+	sp->tail = &sp->head;
+	sp->output = output;
+	sp->ack = ack;
+	sp->ctx = ctx;
+	sp->stopLine.data = stageArgs[0].stopStr;
+	sp->stopLine.len = strlen(stageArgs[0].stopStr);
+	return sp;
+}
+
+/**
+ * @brief Checks whether the next input character can be transformed without overwriting unreleased output.
+ *
+ * A character produces at most two output characters, a held back "+" and itself, so the slot of the line being
+ * formed must be free, and so must the next one if the line may complete.
+ *
+ * @param sp A pointer to the SpanPipeline.
+ * @return 1 if there is room, or 0 otherwise.
+ */
+int spanRoom(const SpanPipeline* sp) {
+	const unsigned long long needed = sp->col + 2 > PRINT_SIZE ? 2 : 1;
+	return sp->produced + needed - sp->released <= sp->nSlots;
+}
+
+/**
+ * @brief Appends one character to the output line being formed, completing the line after PRINT_SIZE characters.
+ *
+ * @param sp A pointer to the SpanPipeline.
+ * @param c The character to append.
+ */
+void spanEmit(SpanPipeline* sp, char c) {
+	char* slot = sp->staging + sp->produced % sp->nSlots * (PRINT_SIZE + 1);
+	slot[sp->col] = c;
+	if (++sp->col == PRINT_SIZE) {
+		slot[PRINT_SIZE] = '\n';
+		sp->col = 0;
+		sp->produced++;
+	}
+}
+
+/**
+ * @brief Transforms one input character.
+ *
+ * A "+" is held back until the next character shows whether it starts a "++". Input lines end at a line separator or
+ * after LINE_SIZE - 1 characters, where a held back "+" is written as is, like the pipeline, which never matches a
+ * "++" across lines.
+ *
+ * @param sp A pointer to the SpanPipeline, which must have room, see spanRoom.
+ * @param c The input character.
+ */
+void spanTransform(SpanPipeline* sp, char c) {
+	const char* stop = stageArgs[0].stopStr;
+	if (sp->stopLen == sp->lineLen && c == stop[sp->stopLen])
+		sp->stopLen++;
+	sp->lineLen++;
+
+	// Replace "++" with "^" and the line separator with a space
+	if (c == '+' && sp->plus) {
+		spanEmit(sp, '^');
+		sp->plus = 0;
+	} else if (c == '+')
+		sp->plus = 1;
+	else {
+		if (sp->plus)
+			spanEmit(sp, '+');
+		sp->plus = 0;
+		spanEmit(sp, c == '\n' ? ' ' : c);
+	}
+
+	// End the line, stopping after the stop line
+	if (c == '\n' || sp->lineLen == LINE_SIZE - 1) {
+		if (sp->plus)
+			spanEmit(sp, '+');
+		sp->stopped = sp->stopLen == sp->lineLen && !stop[sp->stopLen];
+		sp->plus = 0;
+		sp->lineLen = sp->stopLen = 0;
+	}
+}
+
+/**
+ * @brief Copies a run of input characters that need no transform straight into the output line being formed.
+ *
+ * The run ends before the next line separator or "+", before the character that would end the input line, and at the
+ * end of the output line. Runs are only copied once the current input line can no longer be the stop line, and when
+ * no "+" is held back.
+ *
+ * @param sp A pointer to the SpanPipeline, which must have room, see spanRoom.
+ * @param data A pointer to the remaining characters of the input span.
+ * @param len The number of remaining characters.
+ * @return The number of characters copied, which may be 0.
+ */
+size_t spanCopyRun(SpanPipeline* sp, const char* data, size_t len) {
+	if (sp->plus || sp->stopLen == sp->lineLen)
+		return 0;
+
+	// Find the end of the run
+	size_t n = PRINT_SIZE - sp->col;
+	n = n < LINE_SIZE - 2 - sp->lineLen ? n : LINE_SIZE - 2 - sp->lineLen;
+	n = n < len ? n : len;
+	const char* end = memchr(data, '\n', n);
+	n = end ? (size_t) (end - data) : n;
+	end = memchr(data, '+', n);
+	n = end ? (size_t) (end - data) : n;
+
+	// Copy it, completing the output line if it fills it
+	char* slot = sp->staging + sp->produced % sp->nSlots * (PRINT_SIZE + 1);
+	memcpy(slot + sp->col, data, n);
+	sp->col += n;
+	sp->lineLen += n;
+	if (sp->col == PRINT_SIZE) {
+		slot[PRINT_SIZE] = '\n';
+		sp->col = 0;
+		sp->produced++;
+	}
+	return n;
+}
+
+/**
+ * @brief Transforms queued input and hands completed output lines to the caller until input or staging runs out.
+ *
+ * Input spans are acknowledged as soon as their last byte is transformed, and spans still queued after the stop line
+ * are acknowledged without being read. After spanPipelineFinish, the stop line is transformed once all input is,
+ * ending any unterminated last line first, as the input thread does at end of input.
+ *
+ * @param sp A pointer to the SpanPipeline.
+ */
+void spanPipelineRun(SpanPipeline* sp) {
+	if (sp->running)
+		return;
+	sp->running = 1;
+	for (;;) {
+		// Transform queued spans until staging is full
+		SpanInput* in;
+		while ((in = sp->head)) {
+			while (in->done < in->len && !sp->stopped && spanRoom(sp)) {
+				const size_t run = spanCopyRun(sp, in->data + in->done, in->len - in->done);
+				if (run)
+					in->done += run;
+				else
+					spanTransform(sp, in->data[in->done++]);
+			}
+			if (in->done < in->len && !sp->stopped)
+				break;
+			if (!(sp->head = in->next))
+				sp->tail = &sp->head;
+			if (in != &sp->stopLine)
+				sp->ack(sp->ctx, in);
+		}
+
+		// Queue the stop line at end of input, after ending an unterminated last line
+		if (!sp->head && sp->eof && !sp->stopped && !sp->stopQueued) {
+			if (sp->lineLen) {
+				if (sp->plus)
+					spanEmit(sp, '+');
+				sp->plus = 0;
+				sp->lineLen = sp->stopLen = 0;
+			}
+			sp->stopQueued = 1;
+			*sp->tail = &sp->stopLine;
+			sp->tail = &sp->stopLine.next;
+			continue;
+		}
+
+		// Hand completed lines to the caller, in up to two spans if they wrap around the end of staging
+		while (sp->delivered < sp->produced) {
+			const size_t first = sp->delivered % sp->nSlots;
+			size_t lines = sp->produced - sp->delivered;
+			lines = lines < sp->nSlots - first ? lines : sp->nSlots - first;
+			sp->delivered += lines;
+			sp->output(sp->ctx, sp->staging + first * (PRINT_SIZE + 1), lines * (PRINT_SIZE + 1));
+		}
+
+		// Continue if the callback released room for input still queued
+		if (!sp->head || !spanRoom(sp))
+			break;
+	}
+	sp->running = 0;
+}
+
+/**
+ * @brief Queues a span of input and transforms as much queued input as staging allows.
+ *
+ * @param sp A pointer to the SpanPipeline.
+ * @param input A pointer to the SpanInput, with data and len filled in, to keep alive until it is acknowledged.
+ */
+void spanPipelineSubmit(SpanPipeline* sp, SpanInput* input) {
+	input->done = 0;
+	input->next = NULL;
+	*sp->tail = input;
+	sp->tail = &input->next;
+	spanPipelineRun(sp);
+}
+
+/**
+ * @brief Releases the oldest output handed to the caller, letting the pipeline reuse its staging memory.
+ *
+ * Output must be released in the order it was received, in whole output spans or whole lines. Releasing may be done
+ * from within the output callback.
+ *
+ * @param sp A pointer to the SpanPipeline.
+ * @param len The number of bytes to release.
+ */
+void spanPipelineRelease(SpanPipeline* sp, size_t len) {
+	sp->released += len / (PRINT_SIZE + 1);
+	spanPipelineRun(sp);
+}
+
+/**
+ * @brief Marks the end of input, after which the pipeline transforms the stop line once the queued input is done.
+ *
+ * As in the pipeline, characters that do not fill a whole output line are never output.
+ *
+ * @param sp A pointer to the SpanPipeline.
+ */
+void spanPipelineFinish(SpanPipeline* sp) {
+	sp->eof = 1;
+	spanPipelineRun(sp);
+}
+
+/**
+ * @brief Checks whether a span pipeline has transformed its stop line and handed all output to the caller.
+ *
+ * @param sp A pointer to the SpanPipeline.
+ * @return 1 if the pipeline is done, or 0 otherwise.
+ */
+int spanPipelineDone(const SpanPipeline* sp) {
+	return sp->stopped && !sp->head && sp->delivered == sp->produced;
+}
+
+/**
+ * @brief Frees a span pipeline. Queued input is not acknowledged.
+ *
+ * @param sp A pointer to the SpanPipeline to free.
+ */
+void spanPipelineDestroy(SpanPipeline* sp) {
+	free(sp->staging);
+	free(sp);
+}
+
+/**
+ * @brief Writes output of the span pipeline straight from its staging memory to stdout, then releases it.
+ *
+ * @param ctx A pointer to the SpanPipeline, so the output can be released.
+ * @param data A pointer to the output in staging memory.
+ * @param len The number of output bytes.
+ */
+void zeroCopyOutput(void* ctx, const char* data, size_t len) {
+	for (size_t done = 0; done < len;) {
+		ssize_t n = write(STDOUT_FILENO, data + done, len - done);
+		if (n < 0 && errno == EPIPE)
+			exit(0);
+		if (n < 0 && errno != EINTR) {
+			fprintf(stderr, "output: cannot write output: %s\n", strerror(errno));
+			exit(1);
+		}
+		done += n > 0 ? n : 0;
+	}
+	spanPipelineRelease(*(SpanPipeline**) ctx, len);
+}
+
+/**
+ * @brief Receives input spans the span pipeline is done with. Since output is released as soon as it is written,
+ * every span is acknowledged before spanPipelineSubmit returns, so there is nothing to do.
+ */
+void zeroCopyAck(void* ctx, SpanInput* input) {
+	(void) ctx;
+	(void) input;
+}
+
+/**
+ * @brief Processes stdin through the zero-copy span interface instead of the four stage pipeline.
+ *
+ * A regular file is mapped from the current offset of stdin to its end and submitted as a single span, so input is read
+ * straight from the page cache. Other input is read into one buffer at a time, each read submitted as a span.
+ *
+ * @return 0 on success, or 1 if the span pipeline could not be created.
+ */
+int zeroCopyRun(void) {
+	static SpanPipeline* sp;
+	if (!(sp = spanPipelineCreate(STAGING_SIZE, zeroCopyOutput, zeroCopyAck, &sp))) {
+		fprintf(stderr, "zero-copy: out of memory\n");
+		return 1;
+	}
+
+	// Submit the rest of a mapped file as one span, mapping it from the page holding the current offset, or each read
+	// as a span
+	struct stat st;
+	SpanInput in = {0};
+	char* data = MAP_FAILED;
+	const off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+	off_t start = 0;
+	if (!fstat(STDIN_FILENO, &st) && S_ISREG(st.st_mode) && offset >= 0 && st.st_size > offset) {
+		start = offset / sysconf(_SC_PAGESIZE) * sysconf(_SC_PAGESIZE);
+		data = mmap(NULL, st.st_size - start, PROT_READ, MAP_PRIVATE, STDIN_FILENO, start);
+	}
+	if (data != MAP_FAILED) {
+		madvise(data, st.st_size - start, MADV_SEQUENTIAL | MADV_WILLNEED);
+		in.data = data + (offset - start);
+		in.len = st.st_size - offset;
+		spanPipelineSubmit(sp, &in);
+		munmap(data, st.st_size - start);
+	} else {
+		char buff[EVENT_IO_SIZE];
+		ssize_t n;
+		while (!spanPipelineDone(sp)
+				&& ((n = read(STDIN_FILENO, buff, sizeof(buff))) > 0 || (n < 0 && errno == EINTR))) {
+			in.data = buff;
+			in.len = n > 0 ? n : 0;
+			spanPipelineSubmit(sp, &in);
+		}
+	}
+	spanPipelineFinish(sp);
+	spanPipelineDestroy(sp);
+	return 0;
+}
+
+/**
+ * @brief Computes a fast 64-bit hash of a block of bytes.
+ *
+ * The hashBytes function consumes the input eight bytes at a time in four independent lanes, so that the multiplies
+ * of neighbouring words overlap in the CPU, and folds the lanes and the remaining tail bytes into a single value with
+ * a final avalanche step. It is not cryptographic, but it spreads similar inputs well and runs close to memory speed.
+ *
+ * @param data A pointer to the bytes to hash.
+ * @param len The number of bytes to hash.
+ * @param seed A value mixed into the hash, allowing unrelated users to keep separate hash spaces.
+ * @return The 64-bit hash of the bytes.
+ */
+uint64_t hashBytes(const void* data, size_t len, uint64_t seed) {
+	const uint64_t k1 = 0x9E3779B97F4A7C15ULL, k2 = 0xC2B2AE3D27D4EB4FULL;
+	const unsigned char* p = data;
+	const size_t total = len;
+	uint64_t lanes[4] = {seed ^ k1, seed ^ k2, seed + k1, seed - k2};
+	uint64_t word, h;
+
+	// Hash 32 bytes at a time across four lanes
+	for (; len >= 32; p += 32, len -= 32)
+		for (int i = 0; i < 4; i++) {
+			memcpy(&word, p + i * 8, 8);
+			lanes[i] = (lanes[i] ^ word) * k1;
+			lanes[i] ^= lanes[i] >> 31;
+		}
+	h = lanes[0] ^ (lanes[1] << 1) ^ (lanes[2] << 2) ^ (lanes[3] << 3) ^ total;
+
+	// Hash remaining words, then remaining bytes
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&word, p, 8);
+		h = (h ^ word) * k2;
+		h ^= h >> 29;
+	}
+	for (; len; p++, len--)
+		h = (h ^ *p) * k1;
+
+	// Avalanche the result
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/**
+ * @struct CacheEntry
+ * @brief A structure holding one transformed line in the line cache.
+ *
+ * @var CacheEntry::key
+ * The hash of the raw line that produced this entry.
+ * @var CacheEntry::size
+ * The number of bytes charged to the cache budget for this entry.
+ * @var CacheEntry::rawLen
+ * The number of characters of the raw line.
+ * @var CacheEntry::text
+ * The raw line, compared on lookup since different lines may share a hash, followed by the fully transformed line,
+ * null terminated.
+ */
+typedef struct {
+	uint64_t key;
+	size_t size, rawLen;
+	char text[];
+} CacheEntry;
+
+/**
+ * @struct LineCache
+ * @brief A structure representing a bounded, set-associative cache from raw lines to their transformed text.
+ *
+ * The LineCache maps the hash of a raw input line to the bytes the transform threads produced for it. Each hash maps
+ * to a set of CACHE_WAYS slots kept in most recently used order, and a new entry replaces the least recently used one
+ * in its set. Every byte the cache owns, including the slot array itself, is charged to a fixed budget; entries that
+ * would exceed the budget are not stored.
+ *
+ * @var LineCache::slots
+ * An array of nSlots entry pointers, grouped into sets of CACHE_WAYS selected by the low bits of the line hash.
+ * @var LineCache::nSlots
+ * The number of slots, always a power of two and a multiple of CACHE_WAYS.
+ * @var LineCache::budget
+ * The maximum number of bytes the cache may use.
+ * @var LineCache::used
+ * The number of bytes currently in use by the slot array and all entries.
+ * @var LineCache::entries
+ * The number of entries currently stored.
+ * @var LineCache::hits
+ * The number of lookups that found a transformed line.
+ * @var LineCache::misses
+ * The number of lookups that had to run the transforms.
+ * @var LineCache::evictions
+ * The number of entries replaced by a newer line in the same set.
+ * @var LineCache::rejects
+ * The number of entries not stored because they would exceed the budget.
+ * @var LineCache::mutex
+ * A mutex used to synchronize the lookup and store threads.
+ */
+typedef struct {
+	CacheEntry** slots;
+	size_t nSlots, budget, used, entries;
+	unsigned long hits, misses, evictions, rejects;
+	pthread_mutex_t mutex;
+} LineCache;
+
+LineCache lineCache;
+
+/**
+ * @brief Initializes the line cache with the given byte budget.
+ *
+ * The lineCacheInit function sizes the slot array to roughly an eighth of the budget, leaving the rest for entries,
+ * and charges the slot array to the budget.
+ *
+ * @param cache A pointer to the LineCache to initialize.
+ * @param budget The maximum number of bytes the cache may use.
+ * @return 0 on success, or -1 if the budget is too small or the slot array could not be allocated.
+ */
+int lineCacheInit(LineCache* cache, size_t budget) {
+	memset(cache, 0, sizeof(*cache));
+	cache->nSlots = CACHE_WAYS;
+	while (cache->nSlots * 2 * sizeof(CacheEntry*) <= budget / 8)
+		cache->nSlots *= 2;
+	cache->budget = budget;
+	cache->used = cache->nSlots * sizeof(CacheEntry*);
+	if (cache->used >= budget || !(cache->slots = calloc(cache->nSlots, sizeof(CacheEntry*))))
+		return -1;
+	pthread_mutex_init(&cache->mutex, NULL);
+	return 0;
+}
+
+/**
+ * @brief Looks up a raw line in the line cache, replacing it with its transformed text on a hit.
+ *
+ * The lineCacheLookup function hashes the raw line and stores the hash in the line's key so that the thread running
+ * the last transform can store the result under it. On a hit, the line's text is replaced by the cached transformed
+ * text and the line is marked as cached, so the remaining transform threads pass it through untouched. On a miss, the
+ * raw line is kept in the line's raw field so the store can file the result under the raw line itself.
+ *
+ * @param cache A pointer to the LineCache to search.
+ * @param line A pointer to the raw Line to look up.
+ */
+void lineCacheLookup(LineCache* cache, Line* line) {
+	// Hash the raw line, reserving 0 for lines that were not looked up
+	const size_t len = strlen(line->text);
+	line->key = hashBytes(line->text, len, 0) | 1;
+	line->cached = 0;
+
+	// Search the set, moving a hit to the front and copying its transformed line
+	pthread_mutex_lock(&cache->mutex);
+	CacheEntry** set = &cache->slots[line->key & (cache->nSlots - CACHE_WAYS)];
+	for (int i = 0; i < CACHE_WAYS && set[i]; i++) {
+		CacheEntry* entry = set[i];
+		if (entry->key != line->key || entry->rawLen != len || memcmp(entry->text, line->text, len))
+			continue;
+		memmove(set + 1, set, i * sizeof(CacheEntry*));
+		set[0] = entry;
+		strcpy(line->text, entry->text + len);
+		line->cached = 1;
+		break;
+	}
+	if (line->cached)
+		cache->hits++;
+	else
+		cache->misses++;
+	pthread_mutex_unlock(&cache->mutex);
+
+	// Keep the raw line of a miss for the store
+	line->rawLen = line->cached ? 0 : len;
+	memcpy(line->raw, line->text, line->rawLen);
+}
+
+/**
+ * @brief Stores a transformed line in the line cache under the hash of its raw text.
+ *
+ * The lineCacheStore function inserts the transformed line at the front of its set, dropping the least recently used
+ * entry if the set is full, unless the new entry would push the cache over its budget, in which case the set is left
+ * unchanged.
+ *
+ * @param cache A pointer to the LineCache to store into.
+ * @param line A pointer to the transformed Line, whose key and raw line were set by lineCacheLookup. The raw line is
+ * dropped so that later stages do not carry it.
+ */
+void lineCacheStore(LineCache* cache, Line* line) {
+	const size_t len = strlen(line->text), rawLen = line->rawLen;
+	const size_t size = sizeof(CacheEntry) + rawLen + len + 1;
+	line->rawLen = 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	CacheEntry** set = &cache->slots[line->key & (cache->nSlots - CACHE_WAYS)];
+	CacheEntry* victim = set[CACHE_WAYS - 1];
+	const size_t freed = victim ? victim->size : 0;
+
+	// Skip lines stored by an earlier miss still in flight
+	for (int i = 0; i < CACHE_WAYS && set[i]; i++)
+		if (set[i]->key == line->key && set[i]->rawLen == rawLen && !memcmp(set[i]->text, line->raw, rawLen)) {
+			pthread_mutex_unlock(&cache->mutex);
+			return;
+		}
+
+	// Reject entries that do not fit in the budget
+	CacheEntry* entry = NULL;
+	if (cache->used - freed + size > cache->budget || !(entry = malloc(size))) {
+		cache->rejects++;
+		pthread_mutex_unlock(&cache->mutex);
+		return;
+	}
+
+	// Fill the new entry, drop the least recently used one and insert at the front
+	entry->key = line->key;
+	entry->size = size;
+	entry->rawLen = rawLen;
+	memcpy(entry->text, line->raw, rawLen);
+	memcpy(entry->text + rawLen, line->text, len + 1);
+	if (victim) {
+		free(victim);
+		cache->evictions++;
+		cache->entries--;
+	}
+	memmove(set + 1, set, (CACHE_WAYS - 1) * sizeof(CacheEntry*));
+	set[0] = entry;
+	cache->used += size - freed;
+	cache->entries++;
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+/**
+ * @brief Prints the line cache hit rate and memory use to stderr and frees the cache.
+ *
+ * @param cache A pointer to the LineCache to report on and destroy.
+ */
+void lineCacheDestroy(LineCache* cache) {
+	const unsigned long lookups = cache->hits + cache->misses;
+	fprintf(stderr, "line cache: %lu hits, %lu misses (%.1f%% hit rate), %lu evictions, %lu rejects\n",
+			cache->hits, cache->misses, lookups ? 100.0 * cache->hits / lookups : 0.0, cache->evictions, cache->rejects);
+	fprintf(stderr, "line cache: %zu entries, %zu of %zu bytes used\n", cache->entries, cache->used, cache->budget);
+
+	for (size_t i = 0; i < cache->nSlots; i++)
+		free(cache->slots[i]);
+	free(cache->slots);
+	pthread_mutex_destroy(&cache->mutex);
+}
+
+/**
+ * @brief Sets up follow mode by watching stdin for appended data.
+ *
+ * The followInit function adds an inotify watch on the file behind stdin. The watch is created before the first read,
+ * so every append after that point queues an event and none can be missed between reaching end of file and waiting.
+ *
+ * @return The inotify file descriptor, or -1 if stdin is not a regular file or cannot be watched.
+ */
+int followInit(void) {
+	struct stat st;
+	if (fstat(STDIN_FILENO, &st) || !S_ISREG(st.st_mode))
+		return -1;
+
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0 || inotify_add_watch(fd, "/proc/self/fd/0", IN_MODIFY) < 0) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int followFd = -1;
+
+/**
+ * @brief Blocks until data is appended to stdin.
+ *
+ * The waitForAppend function sleeps in a blocking read on the inotify descriptor, so an idle follower uses no CPU,
+ * and drains every queued event at once. Events for appends that were already read only cause one extra empty read.
+ * If the file was truncated below the current read position, reading restarts from its beginning.
+ */
+void waitForAppend(void) {
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (read(followFd, events, sizeof(events)) < 0 && errno == EINTR);
+
+	// Start over if the file was truncated
+	struct stat st;
+	if (!fstat(STDIN_FILENO, &st) && st.st_size < ftello(stdin))
+		fseeko(stdin, 0, SEEK_SET);
+}
+
+/**
+ * @brief Reads one line of input from stdin or a merged source.
+ *
+ * The readLine function reads characters up to and including the next line separator, or until LINE_SIZE - 1
+ * characters have been read. A line that is cut short by the end of stdin is completed from appended data in follow
+ * mode, and returned as is otherwise. In event loop and server mode, the line is read from the pipeline's non-blocking
+ * input file descriptor by eventReadLine.
+ *
+ * @param p A pointer to the Pipeline to read input for.
+ * @param file The file to read, stdin unless the pipeline merges several sources, or NULL if it could not be opened.
+ * @param line A character array of LINE_SIZE characters that will store the line.
+ * @return 0 if a line was read, or -1 if the input has ended.
+ */
+int readLine(Pipeline* p, FILE* file, char line[]) {
+	if (p->in.buff)
+		return eventReadLine(p, line);
+	if (!file)
+		return -1;
+
+	size_t len = 0;
+	for (;;) {
+		// Read until a full line is available
+		if (fgets(line + len, LINE_SIZE - len, file)) {
+			len += strlen(line + len);
+			if (line[len - 1] == '\n' || len == LINE_SIZE - 1)
+				return 0;
+			continue;
+		}
+
+		// Wait for more data in follow mode, otherwise return what was read
+		if (followFd < 0 || ferror(file))
+			return len ? 0 : -1;
+		clearerr(file);
+		waitForAppend();
+	}
+}
+
+/**
+ * @struct Rules
+ * @brief A structure holding the replacement rules of the transform stages loaded from a rules file.
+ *
+ * A rule table is never changed once published. A reload publishes a new table and frees the old one only after every
+ * stage that may have been using it has finished its line, so stages read the table without taking a lock.
+ *
+ * @var Rules::search
+ * The string each stage replaces, indexed like the stages, or an empty string if the stage replaces nothing.
+ * @var Rules::replace
+ * The character each stage replaces its search string with.
+ */
+typedef struct {
+	char search[NUM_THREADS][RULE_SIZE];
+	char replace[NUM_THREADS];
+} Rules;
+
+Rules* rules;
+unsigned long rulesEpoch = 1;
+
+/**
+ * @brief Decodes the escape sequences \n, \t, \s (a space) and \\ of a word of a rules file.
+ *
+ * @param word The word, decoded in place.
+ * @return The length of the decoded word, or -1 if it holds an unknown escape sequence.
+ */
+int rulesUnescape(char* word) {
+	char* out = word;
+	for (const char* in = word; *in; in++) {
+		if (*in != '\\')
+			*out++ = *in;
+		else if (*++in == 'n')
+			*out++ = '\n';
+		else if (*in == 't')
+			*out++ = '\t';
+		else if (*in == 's')
+			*out++ = ' ';
+		else if (*in == '\\')
+			*out++ = '\\';
+		else
+			return -1;
+	}
+	*out = '\0';
+	return out - word;
+}
+
+/**
+ * @brief Loads a rule table from a rules file.
+ *
+ * Every line of the file that is not empty or a comment starting with # holds the number of a transform stage, the
+ * string it replaces and the character it replaces it with, separated by blanks, e.g. "2 ++ ^". Transform stages
+ * without a line replace nothing.
+ *
+ * @param path The path of the rules file.
+ * @return The new rule table, or NULL if the file could not be read or holds an invalid rule.
+ */
+Rules* rulesLoad(const char* path) {
+	FILE* file = fopen(path, "r");
+	if (!file) {
+		fprintf(stderr, "rules: cannot open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	Rules* table = calloc(1, sizeof(Rules));
+	char text[LINE_SIZE];
+	for (int n = 1; table && fgets(text, sizeof(text), file); n++) {
+		char search[LINE_SIZE], replace[LINE_SIZE];
+		int stage, fields = sscanf(text, "%d %999s %999s", &stage, search, replace);
+		if (text[strspn(text, " \t\n")] == '#' || fields == EOF)
+			continue;
+		if (fields != 3 || stage < 1 || stage > NUM_THREADS - 2 || rulesUnescape(search) < 1
+				|| strlen(search) >= RULE_SIZE || rulesUnescape(replace) != 1) {
+			fprintf(stderr, "rules: %s:%d: expected a transform stage, a search string and a character\n", path, n);
+			free(table);
+			table = NULL;
+			break;
+		}
+		strcpy(table->search[stage], search);
+		table->replace[stage] = replace[0];
+	}
+	fclose(file);
+	return table;
+}
+
+/**
+ * @brief Enters the rules epoch of a stage and returns the current rule table.
+ *
+ * The table stays valid until the stage calls rulesExit. Entering costs a fence but no lock, and a stage that is
+ * not between rulesEnter and rulesExit, e.g. while it waits for a line, never holds up a reload.
+ *
+ * @param tArgs A pointer to the ThreadArgs of the stage.
+ * @return A pointer to the current rule table.
+ */
+const Rules* rulesEnter(ThreadArgs* tArgs) {
+	__atomic_store_n(&tArgs->epoch, __atomic_load_n(&rulesEpoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&rules, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Leaves the rules epoch of a stage, which then no longer uses the rule table.
+ *
+ * @param tArgs A pointer to the ThreadArgs of the stage.
+ */
+void rulesExit(ThreadArgs* tArgs) {
+	__atomic_store_n(&tArgs->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Reloads the rules file and publishes the new rule table to the stages of a pipeline.
+ *
+ * The new table is published with a single pointer swap and the epoch advanced. The old table is freed once no stage
+ * is still in an earlier epoch, so every line is transformed by exactly one table per stage and none is held up or
+ * dropped. If the file is invalid, the current rules are kept.
+ *
+ * @param p A pointer to the Pipeline whose stages use the rules.
+ */
+void rulesReload(Pipeline* p) {
+	Rules* table = rulesLoad(opts.rulesPath);
+	if (!table) {
+		fprintf(stderr, "rules: keeping the current rules\n");
+		return;
+	}
+	Rules* old = __atomic_exchange_n(&rules, table, __ATOMIC_ACQ_REL);
+	const unsigned long epoch = __atomic_add_fetch(&rulesEpoch, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	// Wait for the stages that may still use the old table to finish their line
+	for (int i = 0; i < p->nStages; i++) {
+		unsigned long entered;
+		while ((entered = __atomic_load_n(&p->args[i].epoch, __ATOMIC_ACQUIRE)) && entered < epoch)
+			sched_yield();
+	}
+	free(old);
+	fprintf(stderr, "rules: reloaded %s\n", opts.rulesPath);
+}
+
+/**
+ * @brief Reloads the rules of a pipeline whenever SIGHUP is received or the rules file changes.
+ *
+ * The thread waits on a signalfd for SIGHUP, which must be blocked in every thread, and on an inotify watch of the
+ * directory of the rules file, so that files replaced by renaming them into place are noticed as well as files written
+ * in place. It runs until it is cancelled.
+ *
+ * @param args A pointer to the Pipeline whose stages use the rules.
+ * @return NULL
+ */
+void* rulesWatcher(void* args) {
+	Pipeline* p = args;
+	sigset_t hup;
+	sigemptyset(&hup);
+	sigaddset(&hup, SIGHUP);
+	const int sigFd = signalfd(-1, &hup, SFD_CLOEXEC);
+
+	// Watch the directory for the file being written or renamed
+	char dir[PATH_MAX];
+	const char* slash = strrchr(opts.rulesPath, '/');
+	const char* name = slash ? slash + 1 : opts.rulesPath;
+	snprintf(dir, sizeof(dir), "%.*s", slash ? (int) (slash - opts.rulesPath) + 1 : 1, slash ? opts.rulesPath : ".");
+	const int watchFd = inotify_init1(IN_CLOEXEC);
+	if (watchFd >= 0)
+		inotify_add_watch(watchFd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+
+	struct pollfd fds[2] = {{sigFd, POLLIN, 0}, {watchFd, POLLIN, 0}};
+	for (;;) {
+		if (poll(fds, 2, -1) < 0)
+			continue;
+		int reload = 0;
+		if (fds[0].revents) {
+			struct signalfd_siginfo info;
+			reload = read(sigFd, &info, sizeof(info)) == sizeof(info);
+		}
+		if (fds[1].revents) {
+			char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+			const ssize_t len = read(watchFd, events, sizeof(events));
+			for (ssize_t off = 0; off < len;) {
+				const struct inotify_event* event = (const struct inotify_event*) (events + off);
+				if (event->len && !strcmp(event->name, name))
+					reload = 1;
+				off += sizeof(*event) + event->len;
+			}
+		}
+		if (reload) {
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			rulesReload(p);
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Reads the monotonic clock.
+ *
+ * @return The current time in seconds.
+ */
+double monotonicTime(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Touches every page of a range of memory, so it is mapped before it is first used.
+ *
+ * @param mem A pointer to the memory, which keeps its contents.
+ * @param len The number of bytes.
+ */
+void prefault(void* mem, size_t len) {
+	volatile char* bytes = mem;
+	const size_t page = sysconf(_SC_PAGESIZE);
+	for (size_t i = 0; i < len; i += page)
+		bytes[i] = bytes[i];
+	if (len)
+		bytes[len - 1] = bytes[len - 1];
+}
+
+/**
+ * @brief Touches the stack a stage may use in real-time mode, so the stage does not fault on it while it runs.
+ */
+void realtimeStack(void) {
+	volatile char stack[REALTIME_STACK / 2];
+	prefault((char*) stack, sizeof(stack));
+}
+
+/**
+ * @brief Prepares a pipeline to run with low jitter once everything its stages use is allocated.
+ *
+ * The realtimeInit function gives stdio its buffers now rather than on first use, touches every page of the pipeline,
+ * its buffers, its pending output and its I/O buffers, and locks all current and future memory of the process, so the
+ * stages neither allocate nor fault once they run. Stage threads get stacks of REALTIME_STACK bytes, which the stages
+ * touch when they start. If a priority was given, this thread is switched to SCHED_FIFO, and the stage threads and
+ * coroutines inherit it. Failing to lock memory or to raise the priority, commonly for lack of privilege, is reported
+ * but not fatal.
+ *
+ * @param p A pointer to the Pipeline to prepare.
+ * @param stdinSize The stdio buffer size of stdin, or 0 if stdin is not read with stdio.
+ * @param stdoutSize The stdio buffer size of stdout, or 0 if stdout is not written with stdio.
+ * @param attr The attributes the stage threads are created with.
+ */
+void realtimeInit(Pipeline* p, size_t stdinSize, size_t stdoutSize, pthread_attr_t* attr) {
+	// Give stdio its buffers for the life of the streams
+	char* buff;
+	if (stdinSize && (buff = malloc(stdinSize))) {
+		prefault(buff, stdinSize);
+		setvbuf(stdin, buff, _IOFBF, stdinSize);
+	}
+	if (stdoutSize && (buff = malloc(stdoutSize))) {
+		prefault(buff, stdoutSize);
+		setvbuf(stdout, buff, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF, stdoutSize);
+	}
+
+	// Map the queues and accumulators, then keep them and everything mapped later in memory
+	prefault(p, sizeof(*p));
+	for (int i = 0; i < NUM_BUFFS; i++)
+		prefault(p->buffers[i].slots ? (void*) p->buffers[i].slots : p->buffers[i].buff, p->buffers[i].size);
+	if (p->in.buff)
+		prefault(p->in.buff, p->in.size);
+	if (p->out.buff)
+		prefault(p->out.buff, p->out.size);
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		fprintf(stderr, "realtime: cannot lock memory, running with prefaulted memory: %s\n", strerror(errno));
+	pthread_attr_setstacksize(attr, REALTIME_STACK);
+
+	// Run ahead of ordinary threads when permitted
+	if (opts.realtimePriority) {
+		const struct sched_param param = {.sched_priority = opts.realtimePriority};
+		const int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (err)
+			fprintf(stderr, "realtime: cannot use SCHED_FIFO priority %d: %s\n", opts.realtimePriority,
+					strerror(err));
+	}
+}
+
+/**
+ * @brief The main processing function executed by each thread.
+ *
+ * The processThread function reads lines of text based on the provided ThreadArgs structure. It reads input from either
+ * a buffer, stdin or a merged source, treating the end of the input as the stop string, and processes the input by
+ * replacing specified substrings with a single character, if required. Lines already transformed by the line cache skip
+ * the replacement. The processed input is then either written to a buffer, printed using the printOutput function, or
+ * formatted to a tee branch's output. The input stage marks the stop string as the end of the input, and every thread
+ * continues processing input until it has passed on that line, or until the pipeline is cancelled. When output is
+ * buffered without stdio, the output thread writes its buffered output whenever it runs out of input and once it is
+ * done. The input stage of a pipeline scheduled by deficit round robin yields once it has read its share of the current
+ * round. In real-time mode, the thread touches its stack before it starts and records the longest time it held a line.
+ *
+ * @param args A pointer to a ThreadArgs structure containing the arguments required for the processing thread.
+ * @return NULL The function returns NULL as it is intended to be used with pthread_create.
+ */
+void* processThread(void* args) {
+	// Get args from thread
+	ThreadArgs* tArgs = (ThreadArgs*) args;
+	Pipeline* p = tArgs->pipeline;
+
+	if (opts.realtime)
+		realtimeStack();
+
+	// Open a merged source in its own input thread, so a FIFO without a writer only holds up this one
+	FILE* in = stdin;
+	if (tArgs->source)
+		in = sourceOpen(tArgs->source);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	
+	// Get, modify and write/output line
+	Line line = {.text = ""};
+	while (!line.stop && !isCancelled(p)) {
+		// Write buffered output before waiting for input
+		if (p->out.end && !tArgs->writeBuff && !tArgs->tee && bufferEmpty(&p->buffers[tArgs->iBuffer - 1], 0))
+			pipelineFlush(p);
+
+		// Populate line string, only accepting cancellation while reading stdin
+		if (tArgs->readBuff) {
+			if (getBuff(&p->buffers[tArgs->iBuffer - 1], tArgs->branch, &line))
+				break;
+		} else {
+			// Leave the rest of the round to other pipelines once this one has admitted its share
+			if (p->weight && p->deficit <= 0)
+				coroutineYield();
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+			if (readLine(p, in, line.text))
+				strcpy(line.text, tArgs->stopStr);
+			else {
+				const size_t len = strlen(line.text);
+				__atomic_add_fetch(&p->lines, 1, __ATOMIC_RELAXED);
+				__atomic_add_fetch(&p->bytes, len, __ATOMIC_RELAXED);
+				if (p->weight)
+					p->deficit -= len;
+			}
+			line.stop = !strcmp(line.text, tArgs->stopStr);
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		}
+		const double got = opts.realtime ? monotonicTime() : 0;
+
+		// Optionally swap in the cached transform of the raw line
+		if (tArgs->cacheLookup)
+			lineCacheLookup(&lineCache, &line);
+
+		// Optionally modify line string, by the current rule table when rules are loaded from a file
+		if (tArgs->searchStr && !line.cached) {
+			if (opts.rulesPath) {
+				const Rules* table = rulesEnter(tArgs);
+				if (table->search[tArgs->iBuffer][0])
+					replaceSubstring(line.text, table->search[tArgs->iBuffer], table->replace[tArgs->iBuffer]);
+				rulesExit(tArgs);
+			} else
+				replaceSubstring(line.text, tArgs->searchStr, tArgs->replaceChar);
+		}
+
+		// Optionally remember the transform of the raw line
+		if (tArgs->cacheStore && !line.cached)
+			lineCacheStore(&lineCache, &line);
+		
+		// Write/Output line string
+		if (tArgs->writeBuff) {
+			if (tArgs->source ? sourcePut(p, tArgs, &line) : putBuff(&p->buffers[tArgs->iBuffer], &line))
+				break;
+		} else if (tArgs->tee)
+			teeOutput(tArgs->tee, line.text);
+		else
+			printOutput(p, line.text);
+
+		// Record the longest the stage held a line, waiting for room downstream included
+		if (opts.realtime && monotonicTime() - got > tArgs->stall)
+			tArgs->stall = monotonicTime() - got;
+	}
+	if (p->out.buff && !tArgs->writeBuff && !tArgs->tee && !isCancelled(p))
+		pipelineFlush(p);
+	return NULL;
+}
+
+/**
+ * @brief The entry point of every coroutine, running its function and marking it as finished.
+ *
+ * When the function returns, the coroutine continues in the scheduler through its uc_link.
+ */
+void coroutineMain(void) {
+	Coroutine* co = currentCoroutine;
+	co->fn(co->args);
+	co->done = 1;
+	coroutineProgress++;
+}
+
+/**
+ * @brief Creates a coroutine and adds it to the end of the scheduler's list.
+ *
+ * The coroutine first runs when the scheduler reaches it, which may be in the current round if the scheduler is
+ * already running.
+ *
+ * @param fn The function the coroutine runs.
+ * @param args The argument passed to fn.
+ * @param pipeline A pointer to the Pipeline the coroutine is a stage of, or NULL.
+ */
+void coroutineSpawn(void* (*fn)(void*), void* args, Pipeline* pipeline) {
+	Coroutine* co = calloc(1, sizeof(*co));
+	if (!co || !(co->stack = malloc(COROUTINE_STACK))) {
+		fprintf(stderr, "coroutines: out of memory\n");
+		exit(1);
+	}
+
+	// Return to the scheduler when done
+	getcontext(&co->context);
+	co->context.uc_stack.ss_sp = co->stack;
+	co->context.uc_stack.ss_size = COROUTINE_STACK;
+	co->context.uc_link = &schedulerContext;
+	makecontext(&co->context, coroutineMain, 0);
+	co->fn = fn;
+	co->args = args;
+	co->pipeline = pipeline;
+	co->waitFd = -1;
+	*coroutineTail = co;
+	coroutineTail = &co->next;
+}
+
+/**
+ * @brief Runs every spawned coroutine on the calling thread until all have finished.
+ *
+ * The runCoroutines function resumes the coroutines round robin. Each coroutine runs until it blocks on a buffer or a
+ * file descriptor, or finishes, in which case it is removed from the list and its stack is freed. Coroutines spawned
+ * while the scheduler runs join the round. After every round in which a coroutine waits for a file descriptor, epoll
+ * is polled so that busy coroutines cannot keep waiting ones from being woken. When a whole round moves no line, every
+ * coroutine is blocked, and the function sleeps in epoll until a file descriptor is ready.
+ *
+ * Pipelines with a weight are scheduled by deficit round robin on the bytes their input stage admits. Every round, a
+ * pipeline's deficit grows by the quantum times its weight, and its input stage yields once the deficit is used up,
+ * so a bulk stream admits no more than its share per round however much input is waiting, and the lines of small
+ * streams wait at most one round. A pipeline that ran out of input with deficit left over does not keep it, as it had
+ * no backlog to spend it on, but a pipeline that overdrew its share by part of a line pays it back the next round.
+ */
+void runCoroutines(void) {
+	for (unsigned long round = 1; coroutineList; round++) {
+		// Resume runnable coroutines round robin, removing finished ones
+		const unsigned long progress = coroutineProgress;
+		int waiting = 0;
+		for (Coroutine** link = &coroutineList; *link;) {
+			Coroutine* co = *link;
+			Pipeline* p = co->pipeline;
+			if (p && p->weight && p->round != round) {
+				p->round = round;
+				p->deficit = (p->deficit < 0 ? p->deficit : 0) + (long) opts.drrQuantum * p->weight;
+			}
+			if (co->waitFd < 0) {
+				currentCoroutine = co;
+				swapcontext(&schedulerContext, &co->context);
+				currentCoroutine = NULL;
+			}
+			if (co->done) {
+				if (!(*link = co->next))
+					coroutineTail = link;
+				free(co->stack);
+				free(co);
+				continue;
+			}
+			waiting += co->waitFd >= 0;
+			link = &co->next;
+		}
+		const int idle = coroutineProgress == progress;
+		if (!coroutineList || !waiting) {
+			if (coroutineList && idle) {
+				fprintf(stderr, "coroutines: deadlock\n");
+				exit(1);
+			}
+			continue;
+		}
+
+		// Wake coroutines whose file descriptor is ready, sleeping until one is when every coroutine is blocked
+		struct epoll_event events[64];
+		int ready;
+		while ((ready = epoll_wait(epollFd, events, 64, idle ? -1 : 0)) < 0 && errno == EINTR);
+		for (int i = 0; i < ready; i++) {
+			Coroutine* co = events[i].data.ptr;
+			epoll_ctl(epollFd, EPOLL_CTL_DEL, co->waitFd, NULL);
+			co->waitFd = -1;
+		}
+	}
+}
+
+/**
+ * @struct Listener
+ * @brief A structure describing a socket the server accepts connections on.
+ *
+ * @var Listener::fd
+ * The listening socket.
+ * @var Listener::weight
+ * The scheduling weight of the pipelines of connections accepted on the socket.
+ */
+typedef struct {
+	int fd;
+	int weight;
+} Listener;
+
+/**
+ * @struct Server
+ * @brief A structure holding the state of server mode, in which every connection to a Unix socket runs its own
+ * pipeline.
+ *
+ * All pipelines run as coroutines on the main thread, so one process serves many clients. A pipeline reserves all the
+ * memory it can ever use when its connection is accepted: its buffers, its input and output buffers and the stacks of
+ * its coroutines. Lines are bounded by LINE_SIZE and every buffer is bounded in bytes, so a pipeline never uses more
+ * than it reserved, however large or fast its input, and a client that does not read its output only stalls its own
+ * pipeline. The reservations of all pipelines are charged to a global budget, and a connection whose pipeline would
+ * exceed it is rejected with an error line instead of taking memory from the others.
+ *
+ * The server may listen on several sockets, each giving its pipelines a weight for the deficit round robin scheduling
+ * of runCoroutines, e.g. a socket for interactive clients with a high weight and one for bulk jobs with a low weight.
+ *
+ * @var Server::listeners
+ * The listening sockets.
+ * @var Server::nListeners
+ * The number of listening sockets.
+ * @var Server::queueBytes
+ * The capacity of each buffer of a pipeline, limited so that the whole pipeline fits in the per pipeline budget.
+ * @var Server::footprint
+ * The number of bytes each pipeline reserves.
+ * @var Server::used
+ * The number of bytes reserved by all open pipelines.
+ * @var Server::peak
+ * The largest number of bytes ever reserved at once.
+ * @var Server::active
+ * The number of open pipelines.
+ * @var Server::admitted
+ * The number of connections given a pipeline so far.
+ * @var Server::rejected
+ * The number of connections rejected because the global budget was exhausted.
+ */
+typedef struct {
+	Listener listeners[MAX_LISTENERS];
+	int nListeners;
+	size_t queueBytes, footprint, used, peak;
+	unsigned long active, admitted, rejected;
+} Server;
+
+Server server;
+
+/**
+ * @brief Computes the number of bytes a server pipeline reserves.
+ *
+ * @param queueBytes The capacity in bytes of each buffer between stages.
+ * @return The size of the Pipeline structure, its buffers, its input and output buffers and its coroutines.
+ */
+size_t pipelineFootprint(size_t queueBytes) {
+	return sizeof(Pipeline) + NUM_BUFFS * (queueBytes / sizeof(Record) * sizeof(Record)) + 2 * EVENT_IO_SIZE
+			+ NUM_THREADS * (sizeof(Coroutine) + COROUTINE_STACK);
+}
+
+/**
+ * @brief Prints the memory use of the server to stderr.
+ *
+ * @param event A short description of the event the line is logged for.
+ * @param p A pointer to the Pipeline the event concerns, or NULL.
+ */
+void serverLog(const char* event, Pipeline* p) {
+	if (p)
+		fprintf(stderr, "server: pipeline %d %s, ", p->id, event);
+	else
+		fprintf(stderr, "server: %s, ", event);
+	if (opts.globalBudget)
+		fprintf(stderr, "%zu of %zu bytes reserved, ", server.used, opts.globalBudget);
+	else
+		fprintf(stderr, "%zu bytes reserved, ", server.used);
+	fprintf(stderr, "peak %zu, %lu open, %lu admitted, %lu rejected\n", server.peak, server.active, server.admitted,
+			server.rejected);
+}
+
+/**
+ * @brief Runs one stage of a server pipeline, closing the connection and freeing the pipeline after its last stage.
+ *
+ * @param args A pointer to the ThreadArgs structure of the stage.
+ * @return NULL The function returns NULL as it is intended to be used with coroutineSpawn.
+ */
+void* serverStage(void* args) {
+	Pipeline* p = ((ThreadArgs*) args)->pipeline;
+	processThread(args);
+	if (--p->running)
+		return NULL;
+
+	// Report what the pipeline used and release its reservation
+	size_t peak = 0;
+	for (int i = 0; i < NUM_BUFFS; i++)
+		peak += p->buffers[i].peak;
+	fprintf(stderr, "server: pipeline %d read %lu lines (%llu bytes)%s, peak buffer use %zu of %zu bytes\n", p->id,
+			p->lines, p->bytes, isCancelled(p) ? " before its client went away" : "", peak,
+			NUM_BUFFS * p->buffers[0].size);
+	close(p->inFd);
+	pipelineDestroy(p);
+	server.used -= p->reserved;
+	server.active--;
+	serverLog("closed", p);
+	free(p);
+	return NULL;
+}
+
+/**
+ * @brief Gives an accepted connection its own pipeline, or rejects it if the global memory budget is exhausted.
+ *
+ * @param fd The non-blocking socket of the connection.
+ * @param weight The scheduling weight of the pipeline.
+ */
+void serverAdmit(int fd, int weight) {
+	// Reject the connection when its reservation does not fit
+	Pipeline* p = NULL;
+	if ((opts.globalBudget && server.used + server.footprint > opts.globalBudget)
+			|| !(p = malloc(sizeof(*p))) || pipelineInit(p, server.queueBytes)) {
+		static const char busy[] = "ERROR server busy\n";
+		if (write(fd, busy, sizeof(busy) - 1) < 0) {}
+		close(fd);
+		free(p);
+		server.rejected++;
+		serverLog("rejected a connection", NULL);
+		return;
+	}
+
+	// Read and write the connection, running every stage as a coroutine
+	p->inFd = p->outFd = fd;
+	ioBufferInit(&p->in, 0);
+	ioBufferInit(&p->out, 0);
+	p->reserved = server.footprint;
+	p->id = ++server.admitted;
+	p->running = p->nStages;
+	p->weight = opts.drrQuantum ? weight : 0;
+	server.used += p->reserved;
+	server.peak = server.used > server.peak ? server.used : server.peak;
+	server.active++;
+	for (int i = 0; i < p->nStages; i++)
+		coroutineSpawn(serverStage, &p->args[i], p);
+	serverLog("admitted", p);
+}
+
+/**
+ * @brief Accepts connections to a listening socket forever, admitting each one.
+ *
+ * @param args A pointer to the Listener to accept connections on.
+ * @return NULL The function does not return.
+ */
+void* serverAccept(void* args) {
+	Listener* listener = args;
+	for (;;) {
+		int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd >= 0)
+			serverAdmit(fd, listener->weight);
+		else if (errno == EAGAIN)
+			coroutineWaitFd(listener->fd, EPOLLIN);
+		else if (errno != EINTR && errno != ECONNABORTED) {
+			fprintf(stderr, "server: cannot accept: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Listens on a Unix socket, replacing a stale socket left at its path by an earlier run.
+ *
+ * @param listener A pointer to the Listener to fill in.
+ * @param spec The path of the socket, optionally followed by a colon and the weight of its pipelines.
+ * @return 0 on success, or -1 if the socket could not be created.
+ */
+int serverListen(Listener* listener, const char* spec) {
+	// Split off the weight
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	size_t len = strlen(spec);
+	const char* colon = strrchr(spec, ':');
+	listener->weight = 1;
+	if (colon && colon[1] && strspn(colon + 1, "0123456789") == strlen(colon + 1)) {
+		listener->weight = atoi(colon + 1);
+		len = colon - spec;
+	}
+	if (len >= sizeof(addr.sun_path) || listener->weight < 1) {
+		fprintf(stderr, "server: invalid socket %s\n", spec);
+		return -1;
+	}
+	memcpy(addr.sun_path, spec, len);
+
+	// Listen on the socket, replacing a stale one
+	struct stat st;
+	if (!lstat(addr.sun_path, &st) && S_ISSOCK(st.st_mode))
+		unlink(addr.sun_path);
+	listener->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listener->fd < 0 || bind(listener->fd, (struct sockaddr*) &addr, sizeof(addr))
+			|| listen(listener->fd, SOMAXCONN)) {
+		fprintf(stderr, "server: cannot listen on %s: %s\n", addr.sun_path, strerror(errno));
+		return -1;
+	}
+	fprintf(stderr, "server: listening on %s with weight %d\n", addr.sun_path, listener->weight);
+	return 0;
+}
+
+/**
+ * @brief Serves pipelines to connections to Unix sockets until the process is killed.
+ *
+ * The serverRun function sizes the buffers of each pipeline to the per pipeline budget, and runs an accept loop for
+ * every socket and all pipelines as coroutines.
+ *
+ * @return 1 if the server could not be started.
+ */
+int serverRun(void) {
+	// Fit the buffers into the per pipeline budget
+	server.queueBytes = opts.queueBytes;
+	if (opts.pipelineBudget) {
+		const size_t fixed = pipelineFootprint(0);
+		server.queueBytes = opts.pipelineBudget > fixed ? (opts.pipelineBudget - fixed) / NUM_BUFFS : 0;
+		server.queueBytes = server.queueBytes < opts.queueBytes ? server.queueBytes : opts.queueBytes;
+		if (server.queueBytes < 2 * recordSize(LINE_SIZE)) {
+			fprintf(stderr, "server: a pipeline needs a budget of at least %zu bytes\n",
+					pipelineFootprint(2 * recordSize(LINE_SIZE)));
+			return 1;
+		}
+	}
+	server.footprint = pipelineFootprint(server.queueBytes);
+	fprintf(stderr, "server: %zu bytes per pipeline\n", server.footprint);
+
+	// Accept on every socket and run pipelines on this thread
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	for (int i = 0; i < opts.nServe; i++) {
+		if (serverListen(&server.listeners[i], opts.serve[i]))
+			return 1;
+		coroutineSpawn(serverAccept, &server.listeners[i], NULL);
+	}
+	server.nListeners = opts.nServe;
+	runCoroutines();
+	return 1;
+}
+
+/**
+ * @struct BenchStream
+ * @brief A structure holding one client stream of the stream mix benchmark.
+ *
+ * @var BenchStream::fd
+ * The connection to the server.
+ * @var BenchStream::bulk
+ * A flag set for the stream that sends input as fast as the server accepts it, instead of one line at a time.
+ * @var BenchStream::bytes
+ * The number of output bytes received.
+ * @var BenchStream::latencies
+ * The round trip time in seconds of every line of a small stream.
+ * @var BenchStream::count
+ * The number of round trip times recorded.
+ * @var BenchStream::capacity
+ * The number of round trip times latencies has room for.
+ */
+typedef struct {
+	int fd;
+	int bulk;
+	unsigned long long bytes;
+	double* latencies;
+	size_t count, capacity;
+} BenchStream;
+
+int benchStop;
+
+/**
+ * @brief Compares two doubles for qsort.
+ */
+int compareDoubles(const void* a, const void* b) {
+	const double x = *(const double*) a, y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief Connects a blocking socket to a Unix socket path.
+ *
+ * @param path The path of the socket.
+ * @return The connected socket, or -1 if the connection failed.
+ */
+int benchConnect(const char* path) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd >= 0 && connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+/**
+ * @brief Sends input on the bulk stream as fast as the server accepts it until the benchmark stops.
+ *
+ * @param args A pointer to the bulk BenchStream.
+ * @return NULL The function returns NULL as it is intended to be used with pthread_create.
+ */
+void* benchBulkWriter(void* args) {
+	BenchStream* s = args;
+	char block[100 * 160];
+	for (size_t i = 0; i < sizeof(block); i++)
+		block[i] = i % 100 == 99 ? '\n' : 'b';
+	while (!__atomic_load_n(&benchStop, __ATOMIC_RELAXED))
+		if (write(s->fd, block, sizeof(block)) < 0)
+			break;
+	return NULL;
+}
+
+/**
+ * @brief Runs one stream of the stream mix benchmark until the benchmark stops.
+ *
+ * The bulk stream writes on a second thread and counts the output it reads. A small stream sends one line of
+ * PRINT_SIZE - 1 characters at a time, which comes back as exactly one output line, records how long that took, and
+ * waits a millisecond before the next line, like an interactive client.
+ *
+ * @param args A pointer to the BenchStream.
+ * @return NULL The function returns NULL as it is intended to be used with pthread_create.
+ */
+void* benchStream(void* args) {
+	BenchStream* s = args;
+	ssize_t n;
+	if (s->bulk) {
+		pthread_t writer;
+		char buff[1 << 16];
+		pthread_create(&writer, NULL, benchBulkWriter, s);
+		while ((n = read(s->fd, buff, sizeof(buff))) > 0)
+			s->bytes += n;
+		pthread_join(writer, NULL);
+		return NULL;
+	}
+
+	// Time the round trip of one line at a time
+	char line[PRINT_SIZE], reply[PRINT_SIZE + 1];
+	memset(line, 's', PRINT_SIZE - 1);
+	line[PRINT_SIZE - 1] = '\n';
+	while (!__atomic_load_n(&benchStop, __ATOMIC_RELAXED)) {
+		const double start = monotonicTime();
+		if (write(s->fd, line, sizeof(line)) != sizeof(line))
+			break;
+		size_t got = 0;
+		while (got < sizeof(reply) && (n = read(s->fd, reply + got, sizeof(reply) - got)) > 0)
+			got += n;
+		if (got < sizeof(reply))
+			break;
+		if (s->count == s->capacity) {
+			s->capacity = s->capacity ? s->capacity * 2 : 1024;
+			if (!(s->latencies = realloc(s->latencies, s->capacity * sizeof(double)))) {
+				fprintf(stderr, "bench: out of memory\n");
+				exit(1);
+			}
+		}
+		s->latencies[s->count++] = monotonicTime() - start;
+		s->bytes += got;
+		usleep(1000);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Measures how a server shares its pipelines between one bulk stream and many small streams.
+ *
+ * The benchStreams function connects one bulk stream and BENCH_SMALL_STREAMS small streams, runs them for
+ * BENCH_SECONDS seconds, and prints the output throughput of the bulk stream and the round trip latency percentiles
+ * of the lines of the small streams. The bulk and small streams may connect to different sockets of the server, so
+ * they can be given different weights.
+ *
+ * @param spec The socket path of all streams, or the socket paths of the bulk and small streams separated by a comma.
+ * @return 0 on success, or 1 if a stream could not connect.
+ */
+int benchStreams(const char* spec) {
+	char bulkPath[PATH_MAX];
+	const char* comma = strchr(spec, ',');
+	const char* smallPath = comma ? comma + 1 : spec;
+	snprintf(bulkPath, sizeof(bulkPath), "%.*s", comma ? (int) (comma - spec) : (int) strlen(spec), spec);
+
+	// Connect and start every stream
+	BenchStream streams[BENCH_SMALL_STREAMS + 1] = {{0}};
+	pthread_t threads[BENCH_SMALL_STREAMS + 1];
+	for (int i = 0; i <= BENCH_SMALL_STREAMS; i++) {
+		streams[i].bulk = !i;
+		if ((streams[i].fd = benchConnect(i ? smallPath : bulkPath)) < 0) {
+			fprintf(stderr, "bench: cannot connect to %s: %s\n", i ? smallPath : bulkPath, strerror(errno));
+			return 1;
+		}
+	}
+	const double start = monotonicTime();
+	for (int i = 0; i <= BENCH_SMALL_STREAMS; i++)
+		pthread_create(&threads[i], NULL, benchStream, &streams[i]);
+
+	// Stop every stream after the run, waking blocked reads and writes
+	sleep(BENCH_SECONDS);
+	__atomic_store_n(&benchStop, 1, __ATOMIC_RELAXED);
+	const double elapsed = monotonicTime() - start;
+	for (int i = 0; i <= BENCH_SMALL_STREAMS; i++)
+		shutdown(streams[i].fd, SHUT_RDWR);
+	for (int i = 0; i <= BENCH_SMALL_STREAMS; i++) {
+		pthread_join(threads[i], NULL);
+		close(streams[i].fd);
+	}
+
+	// Gather the latencies of all small streams
+	size_t count = 0;
+	for (int i = 1; i <= BENCH_SMALL_STREAMS; i++)
+		count += streams[i].count;
+	double* all = malloc((count + 1) * sizeof(double));
+	count = 0;
+	for (int i = 1; i <= BENCH_SMALL_STREAMS; i++) {
+		memcpy(all + count, streams[i].latencies, streams[i].count * sizeof(double));
+		count += streams[i].count;
+		free(streams[i].latencies);
+	}
+	qsort(all, count, sizeof(double), compareDoubles);
+
+	printf("bulk stream:   %.1f MB/s of output\n", streams[0].bytes / elapsed / 1e6);
+	if (count)
+		printf("small streams: %zu lines, round trip p50 %.0f us, p99 %.0f us, max %.0f us\n", count,
+				all[count / 2] * 1e6, all[count * 99 / 100] * 1e6, all[count - 1] * 1e6);
+	else
+		printf("small streams: no line completed\n");
+	free(all);
+	return 0;
+}
+
+/**
+ * @brief Computes a hash of the processing rules configured for the threads.
+ *
+ * The hashRules function hashes the stop string, search string and replacement character of every thread along with
+ * the output line width, so that cached results are never reused after the rules change.
+ *
+ * @param args An array of ThreadArgs structures describing the threads.
+ * @param n The number of threads.
+ * @return The 64-bit hash of the rules.
+ */
+uint64_t hashRules(const ThreadArgs args[], int n) {
+	uint64_t h = hashBytes("rules", 5, PRINT_SIZE);
+	for (int i = 0; i < n; i++) {
+		const char* search = args[i].searchStr ? args[i].searchStr : "";
+		if (args[i].stopStr)
+			h = hashBytes(args[i].stopStr, strlen(args[i].stopStr), h);
+		h = hashBytes(search, strlen(search) + 1, h);
+		h = hashBytes(&args[i].replaceChar, 1, h);
+	}
+	return h;
+}
+
+/**
+ * @brief Copies the whole content of one file descriptor to another without going through user space if possible.
+ *
+ * The copyFile function uses copy_file_range, which lets the file system share or copy extents directly, and falls
+ * back to sendfile when the output is not a regular file, and to plain reads and writes if neither is supported.
+ *
+ * @param in The file descriptor to copy from, positioned at its start.
+ * @param out The file descriptor to copy to.
+ * @return 0 on success, or -1 if an error occurred.
+ */
+int copyFile(int in, int out) {
+	ssize_t n;
+
+	// Try copy_file_range, then sendfile, until one copies everything
+	while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0);
+	if (!n)
+		return 0;
+	while ((n = sendfile(out, in, NULL, 1 << 30)) > 0);
+	if (!n)
+		return 0;
+	if (errno != EINVAL && errno != ENOSYS && errno != EXDEV)
+		return -1;
+
+	// Fall back to copying through a buffer
+	char buff[1 << 16];
+	while ((n = read(in, buff, sizeof(buff))) > 0)
+		for (ssize_t done = 0, w; done < n; done += w)
+			if ((w = write(out, buff + done, n - done)) < 0)
+				return -1;
+	return n ? -1 : 0;
+}
+
+/**
+ * @brief Looks up the output of the whole input in the result cache, serving it if present.
+ *
+ * The resultCacheLookup function only applies when stdin is a regular file. It maps the input from the current offset
+ * of stdin to its end, as the threads will read it, and hashes it together with the rules hash without moving the
+ * offset. If an output for the same hash and input size exists in the cache directory, it is copied to stdout.
+ * Otherwise a temporary file is opened in the cache directory and the output of this run is recorded to it.
+ *
+ * @param cache A pointer to the ResultCache to fill in.
+ * @param dir The cache directory.
+ * @param rules The hash of the processing rules, see hashRules.
+ * @return 1 if the cached output was written to stdout, or 0 if the input must be processed.
+ */
+int resultCacheLookup(ResultCache* cache, const char* dir, uint64_t rules) {
+	// Only regular files can be hashed up front
+	struct stat st;
+	const off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+	if (fstat(STDIN_FILENO, &st) || !S_ISREG(st.st_mode) || offset < 0)
+		return 0;
+
+	// Hash the input left to read, mapping it from the page holding the current offset
+	const off_t size = st.st_size > offset ? st.st_size - offset : 0;
+	uint64_t hash = hashBytes(NULL, 0, rules);
+	if (size) {
+		const off_t start = offset / sysconf(_SC_PAGESIZE) * sysconf(_SC_PAGESIZE);
+		const size_t length = st.st_size - start;
+		char* data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, STDIN_FILENO, start);
+		if (data == MAP_FAILED)
+			return 0;
+		madvise(data, length, MADV_SEQUENTIAL | MADV_WILLNEED);
+		hash = hashBytes(data + (offset - start), size, rules);
+		munmap(data, length);
+	}
+	snprintf(cache->path, sizeof(cache->path), "%s/%016llx-%llx.out", dir,
+			(unsigned long long) hash, (unsigned long long) size);
+
+	// Serve the cached output on a hit
+	int fd = open(cache->path, O_RDONLY);
+	if (fd >= 0) {
+		int served = !copyFile(fd, STDOUT_FILENO);
+		close(fd);
+		if (served)
+			return 1;
+		fprintf(stderr, "result cache: failed to copy %s: %s\n", cache->path, strerror(errno));
+		exit(1);
+	}
+
+	// Record the output of this run on a miss
+	snprintf(cache->tmpPath, sizeof(cache->tmpPath), "%s.%d.tmp", cache->path, (int) getpid());
+	if (!(cache->file = fopen(cache->tmpPath, "w")))
+		fprintf(stderr, "result cache: cannot create %s: %s\n", cache->tmpPath, strerror(errno));
+	return 0;
+}
+
+/**
+ * @brief Moves the recorded output into the result cache once the input has been fully processed.
+ *
+ * Output of a cancelled run is incomplete and is discarded instead.
+ *
+ * @param cache A pointer to the ResultCache being recorded.
+ */
+void resultCacheFinish(ResultCache* cache) {
+	if (!cache->file)
+		return;
+	if (isCancelled(&mainPipeline)) {
+		fclose(cache->file);
+		unlink(cache->tmpPath);
+	} else if (fclose(cache->file) || rename(cache->tmpPath, cache->path)) {
+		fprintf(stderr, "result cache: cannot store %s: %s\n", cache->path, strerror(errno));
+		unlink(cache->tmpPath);
+	}
+	cache->file = NULL;
+}
+
+/**
+ * @brief Parses a byte count with an optional K, M or G suffix.
+ *
+ * @param str The string to parse, e.g. "64M".
+ * @param size A pointer to the variable that will store the parsed number of bytes.
+ * @return 0 on success, or -1 if the string is not a valid byte count.
+ */
+int parseSize(const char* str, size_t* size) {
+	char* end;
+	unsigned long long value = strtoull(str, &end, 10);
+	if (end == str)
+		return -1;
+
+	// Apply the optional binary suffix
+	switch (*end) {
+		case 'G': case 'g': value <<= 10; // fall through
+		case 'M': case 'm': value <<= 10; // fall through
+		case 'K': case 'k': value <<= 10; end++; break;
+	}
+	if (*end)
+		return -1;
+	*size = value;
+	return 0;
+}
+
+/**
+ * @struct Limits
+ * @brief A structure holding the CPUs and memory available to the process.
+ *
+ * @var Limits::cpus
+ * The number of CPUs the process can keep busy: those it may run on, lowered to its cgroup's CPU quota rounded up.
+ * @var Limits::memory
+ * The memory limit of the process's cgroup in bytes, or 0 if there is none.
+ */
+typedef struct {
+	int cpus;
+	size_t memory;
+} Limits;
+
+Limits limits;
+
+/**
+ * @brief Reads the first line of a file of a cgroup.
+ *
+ * @param dir The directory of the cgroup.
+ * @param name The name of the file.
+ * @param line A character array of LINE_SIZE characters that will store the line.
+ * @return 0 if the line was read, or -1 if the file does not exist or is empty.
+ */
+int cgroupRead(const char* dir, const char* name, char line[]) {
+	char path[PATH_MAX + 32];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	FILE* file = fopen(path, "r");
+	if (!file)
+		return -1;
+	const int ok = fgets(line, LINE_SIZE, file) != NULL;
+	fclose(file);
+	return ok ? 0 : -1;
+}
+
+/**
+ * @brief Lowers limits to the cgroup v2 CPU quota and memory limit of a cgroup and all its ancestors.
+ *
+ * The cpu.max file holds the quota and period in microseconds, or "max" for no quota, and memory.max the limit in
+ * bytes or "max". A quota of 1.5 periods still keeps a second CPU busy part of the time, so it counts as 2 CPUs. The
+ * tightest limit of any ancestor applies.
+ *
+ * @param root The mount point of the cgroup v2 hierarchy.
+ * @param path The path of the cgroup below the mount point, starting with a slash.
+ * @param l A pointer to the Limits to lower.
+ */
+void cgroupLimits(const char* root, const char* path, Limits* l) {
+	char dir[PATH_MAX], line[LINE_SIZE];
+	snprintf(dir, sizeof(dir), "%s%s", root, strcmp(path, "/") ? path : "");
+	for (;;) {
+		unsigned long long quota, period, memory;
+		if (!cgroupRead(dir, "cpu.max", line) && sscanf(line, "%llu %llu", &quota, &period) == 2 && quota && period) {
+			const int cpus = (quota + period - 1) / period;
+			if (cpus < l->cpus)
+				l->cpus = cpus;
+		}
+		if (!cgroupRead(dir, "memory.max", line) && sscanf(line, "%llu", &memory) == 1
+				&& (!l->memory || memory < l->memory))
+			l->memory = memory;
+
+		// Move up to the parent until the root of the hierarchy
+		char* slash = strrchr(dir, '/');
+		if (strlen(dir) <= strlen(root) || !slash)
+			break;
+		*slash = '\0';
+	}
+}
+
+/**
+ * @brief Finds the CPUs and memory available to the process.
+ *
+ * The limitsInit function counts the CPUs in the process's affinity mask, then finds the cgroup v2 hierarchy in
+ * /proc/self/mountinfo and the process's cgroup in /proc/self/cgroup and lowers the limits to those of the cgroup. A
+ * container sees the CPUs of the whole host, so without the quota sizing by CPU count would oversubscribe it.
+ */
+void limitsInit(void) {
+	cpu_set_t set;
+	limits.cpus = sched_getaffinity(0, sizeof(set), &set) ? sysconf(_SC_NPROCESSORS_ONLN) : CPU_COUNT(&set);
+	limits.memory = 0;
+
+	// Find where the cgroup v2 hierarchy is mounted, and which of its directories it was mounted from
+	char line[LINE_SIZE], mountRoot[PATH_MAX] = "", root[PATH_MAX] = "", path[PATH_MAX] = "";
+	FILE* file = fopen("/proc/self/mountinfo", "r");
+	while (file && fgets(line, sizeof(line), file)) {
+		char mountSource[PATH_MAX], mountPoint[PATH_MAX];
+		const char* fields = strstr(line, " - ");
+		if (fields && !strncmp(fields, " - cgroup2 ", 11)
+				&& sscanf(line, "%*s %*s %*s %4095s %4095s", mountSource, mountPoint) == 2) {
+			snprintf(mountRoot, sizeof(mountRoot), "%s", mountSource);
+			snprintf(root, sizeof(root), "%s", mountPoint);
+			break;
+		}
+	}
+	if (file)
+		fclose(file);
+
+	// Find the process's cgroup, relative to the mounted directory
+	file = fopen("/proc/self/cgroup", "r");
+	while (file && fgets(line, sizeof(line), file))
+		if (!strncmp(line, "0::", 3)) {
+			line[strcspn(line, "\n")] = '\0';
+			const size_t skip = strcmp(mountRoot, "/") && !strncmp(line + 3, mountRoot, strlen(mountRoot))
+					? strlen(mountRoot) : 0;
+			snprintf(path, sizeof(path), "%s", line[3 + skip] ? line + 3 + skip : "/");
+			break;
+		}
+	if (file)
+		fclose(file);
+	if (root[0] && path[0])
+		cgroupLimits(root, path, &limits);
+	if (limits.cpus < 1)
+		limits.cpus = 1;
+}
+
+/**
+ * @brief Lowers the buffer sizes of the options to fit the memory available to the process.
+ *
+ * Buffers and the line cache may each take up to 1 / MEMORY_SHARE of the cgroup's memory limit, leaving the rest to
+ * the input, output and the process itself, and a server without a global budget is given that share as its budget.
+ * A size lowered from what was asked for is reported.
+ */
+void limitsApply(void) {
+	if (!limits.memory)
+		return;
+	const size_t share = limits.memory / MEMORY_SHARE;
+	if (opts.queueBytes > share / NUM_BUFFS) {
+		opts.queueBytes = share / NUM_BUFFS > 2 * recordSize(LINE_SIZE) ? share / NUM_BUFFS : 2 * recordSize(LINE_SIZE);
+		fprintf(stderr, "limits: queue bytes lowered to %zu to fit memory.max of %zu bytes\n", opts.queueBytes,
+				limits.memory);
+	}
+	if (opts.lineCacheBytes > share) {
+		opts.lineCacheBytes = share;
+		fprintf(stderr, "limits: line cache lowered to %zu bytes to fit memory.max of %zu bytes\n",
+				opts.lineCacheBytes, limits.memory);
+	}
+	if (opts.nServe && (!opts.globalBudget || opts.globalBudget > share))
+		opts.globalBudget = share;
+}
+
+/**
+ * @brief Prints the command-line usage of the program to stderr.
+ *
+ * @param name The name the program was started with.
+ */
+void printUsage(const char* name) {
+	fprintf(stderr, "Usage: %s [options] < input > output\n", name);
+	fprintf(stderr, "  --queue-bytes=BYTES capacity of each buffer between stages (default %d)\n", QUEUE_SIZE);
+	fprintf(stderr, "  --spill-max=BYTES   spill lines waiting for output to a file of at most BYTES\n");
+	fprintf(stderr, "  --spill-dir=DIR     create the spill file in DIR (default /tmp)\n");
+	fprintf(stderr, "  --line-cache=BYTES  cache transformed lines within a fixed byte budget\n");
+	fprintf(stderr, "  --cache-dir=DIR     reuse the output of identical input files stored in DIR\n");
+	fprintf(stderr, "  --follow            keep processing data appended to the input file until STOP\n");
+	fprintf(stderr, "  --output=PATH       write output to PATH instead of stdout\n");
+	fprintf(stderr, "  --rotate-bytes=N    start a new output file before it exceeds N bytes\n");
+	fprintf(stderr, "  --rotate-lines=N    start a new output file after N lines\n");
+	fprintf(stderr, "  --compress          gzip rotated output files once they are closed\n");
+	fprintf(stderr, "  --direct            write output files with O_DIRECT, bypassing the page cache\n");
+	fprintf(stderr, "  --coroutines        run all pipeline stages as coroutines on a single thread\n");
+	fprintf(stderr, "  --event-loop        use non-blocking stdin and stdout driven by epoll (implies --coroutines)\n");
+	fprintf(stderr, "  --realtime          prefault and lock memory at startup and report the longest stage stall\n");
+	fprintf(stderr, "  --realtime-priority=PRIO  also run the stages with SCHED_FIFO priority PRIO if permitted\n");
+	fprintf(stderr, "  --serve=PATH[:W]    run a pipeline for every connection to the Unix socket PATH, scheduled\n");
+	fprintf(stderr, "                      with weight W (default 1); may be given up to %d times\n", MAX_LISTENERS);
+	fprintf(stderr, "  --drr-quantum=BYTES input a server pipeline of weight 1 admits per round, 0 for round robin\n");
+	fprintf(stderr, "                      (default %d)\n", DRR_QUANTUM);
+	fprintf(stderr, "  --tee=PATH          also write the input formatted without the plus sign rule to PATH\n");
+	fprintf(stderr, "  --tee-width=N       characters per line written to the tee (default %d)\n", PRINT_SIZE);
+	fprintf(stderr, "  --input=PATH        read PATH instead of stdin; given several times, the files are read in\n");
+	fprintf(stderr, "                      parallel and merged (up to %d)\n", MAX_SOURCES);
+	fprintf(stderr, "  --merge=POLICY      merge inputs by arrival (default) or in the order they were given\n");
+	fprintf(stderr, "  --rules=PATH        load the replacement rules from PATH, reloading them on SIGHUP or when\n");
+	fprintf(stderr, "                      PATH changes\n");
+	fprintf(stderr, "  --spin=N            checks of a queue before a waiting stage sleeps (default %d)\n",
+			limits.cpus < NUM_THREADS ? 0 : MPMC_SPINS);
+	fprintf(stderr, "  --io-bytes=BYTES    stdio buffer size of stdin and stdout when they are not pipes\n");
+	fprintf(stderr, "  --autotune=INPUT    time trials on INPUT across queue, spin and I/O settings and write the\n");
+	fprintf(stderr, "                      fastest within the latency ceiling to the profile\n");
+	fprintf(stderr, "  --latency-max=MS    queueing latency ceiling of --autotune (default %.0f)\n", AUTOTUNE_LATENCY);
+	fprintf(stderr, "  --profile=PATH      profile loaded by every run (default ~/.line_processor_profile)\n");
+	fprintf(stderr, "  --queue=KIND        back the buffers between stages by a mutex protected ring (default)\n");
+	fprintf(stderr, "                      or by a lock-free multi-producer multi-consumer queue (mpmc)\n");
+	fprintf(stderr, "  --bench-scaling=INPUT  measure strong and weak scaling of 1, 2, 4, ... pipelines run in\n");
+	fprintf(stderr, "                      parallel on INPUT, printing a table and writing a CSV file\n");
+	fprintf(stderr, "  --bench-workers=N   largest number of parallel pipelines (default: available CPUs)\n");
+	fprintf(stderr, "  --bench-csv=PATH    CSV file of the scaling benchmark (default scaling.csv)\n");
+	fprintf(stderr, "  --bench-roofline=INPUT  compare the read, split, replace and format kernels on INPUT to\n");
+	fprintf(stderr, "                      the memory bandwidth of reading and of memcpy\n");
+	fprintf(stderr, "  --bench-latency=RATE[,SECONDS]  send lines to the pipeline at RATE lines/s for SECONDS\n");
+	fprintf(stderr, "                      (default 10) and print end to end latency percentiles\n");
+	fprintf(stderr, "  --zero-copy         transform stdin in a single pass through the span interface\n");
+	fprintf(stderr, "  --bench-streams=PATH[,PATH]  measure one bulk and %d small streams against a server\n",
+			BENCH_SMALL_STREAMS);
+	fprintf(stderr, "  --pipeline-budget=BYTES  limit the memory of each server pipeline to BYTES\n");
+	fprintf(stderr, "  --global-budget=BYTES    reject connections once server pipelines would exceed BYTES\n");
+}
+
+/**
+ * @brief Parses the command-line arguments into the global options.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv An array of pointers to the command-line argument strings.
+ * @return 0 on success, or -1 if an argument is invalid.
+ */
+int parseOptions(int argc, char* argv[]) {
+	static const struct option longOpts[] = {
+		{"queue-bytes", required_argument, NULL, 'q'},
+		{"spill-max", required_argument, NULL, 's'},
+		{"spill-dir", required_argument, NULL, 'S'},
+		{"line-cache", required_argument, NULL, 'c'},
+		{"cache-dir", required_argument, NULL, 'd'},
+		{"follow", no_argument, NULL, 'f'},
+		{"output", required_argument, NULL, 'o'},
+		{"rotate-bytes", required_argument, NULL, 'b'},
+		{"rotate-lines", required_argument, NULL, 'l'},
+		{"compress", no_argument, NULL, 'z'},
+		{"direct", no_argument, NULL, 'D'},
+		{"coroutines", no_argument, NULL, 'C'},
+		{"event-loop", no_argument, NULL, 'E'},
+		{"serve", required_argument, NULL, 'V'},
+		{"pipeline-budget", required_argument, NULL, 'p'},
+		{"global-budget", required_argument, NULL, 'g'},
+		{"drr-quantum", required_argument, NULL, 'Q'},
+		{"bench-streams", required_argument, NULL, 'B'},
+		{"zero-copy", no_argument, NULL, 'Z'},
+		{"tee", required_argument, NULL, 'T'},
+		{"tee-width", required_argument, NULL, 'W'},
+		{"input", required_argument, NULL, 'I'},
+		{"merge", required_argument, NULL, 'M'},
+		{"queue", required_argument, NULL, 'K'},
+		{"rules", required_argument, NULL, 'R'},
+		{"spin", required_argument, NULL, 'N'},
+		{"io-bytes", required_argument, NULL, 'O'},
+		{"autotune", required_argument, NULL, 'A'},
+		{"profile", required_argument, NULL, 'P'},
+		{"latency-max", required_argument, NULL, 'L'},
+		{"bench-scaling", required_argument, NULL, 'G'},
+		{"bench-workers", required_argument, NULL, 'w'},
+		{"bench-csv", required_argument, NULL, 'v'},
+		{"bench-roofline", required_argument, NULL, 'F'},
+		{"bench-latency", required_argument, NULL, 'J'},
+		{"realtime", no_argument, NULL, 'r'},
+		{"realtime-priority", required_argument, NULL, 'y'},
+		{NULL, 0, NULL, 0}
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", longOpts, NULL)) != -1) {
+		switch (opt) {
+			case 'q':
+				if (parseSize(optarg, &opts.queueBytes))
+					return -1;
+				break;
+			case 's':
+				if (parseSize(optarg, &opts.spillMax))
+					return -1;
+				break;
+			case 'S':
+				opts.spillDir = optarg;
+				break;
+			case 'c':
+				if (parseSize(optarg, &opts.lineCacheBytes))
+					return -1;
+				break;
+			case 'd':
+				opts.cacheDir = optarg;
+				break;
+			case 'f':
+				opts.follow = 1;
+				break;
+			case 'o':
+				opts.outputPath = optarg;
+				break;
+			case 'b':
+				if (parseSize(optarg, &opts.rotateBytes))
+					return -1;
+				break;
+			case 'l':
+				if (parseSize(optarg, &opts.rotateLines))
+					return -1;
+				break;
+			case 'z':
+				opts.compress = 1;
+				break;
+			case 'D':
+				opts.direct = 1;
+				break;
+			case 'C':
+				opts.coroutines = 1;
+				break;
+			case 'E':
+				opts.eventLoop = opts.coroutines = 1;
+				break;
+			case 'V':
+				if (opts.nServe == MAX_LISTENERS)
+					return -1;
+				opts.serve[opts.nServe++] = optarg;
+				break;
+			case 'p':
+				if (parseSize(optarg, &opts.pipelineBudget))
+					return -1;
+				break;
+			case 'g':
+				if (parseSize(optarg, &opts.globalBudget))
+					return -1;
+				break;
+			case 'Q':
+				if (parseSize(optarg, &opts.drrQuantum))
+					return -1;
+				break;
+			case 'B':
+				opts.benchStreams = optarg;
+				break;
+			case 'Z':
+				opts.zeroCopy = 1;
+				break;
+			case 'T':
+				opts.teePath = optarg;
+				break;
+			case 'W':
+				if (parseSize(optarg, &opts.teeWidth) || !opts.teeWidth)
+					return -1;
+				break;
+			case 'I':
+				if (opts.nInputs == MAX_SOURCES)
+					return -1;
+				opts.inputs[opts.nInputs++] = optarg;
+				break;
+			case 'M':
+				if (!strcmp(optarg, "order"))
+					opts.mergeOrder = 1;
+				else if (strcmp(optarg, "arrival"))
+					return -1;
+				break;
+			case 'K':
+				if (!strcmp(optarg, "mpmc"))
+					opts.mpmcQueues = 1;
+				else if (strcmp(optarg, "ring"))
+					return -1;
+				break;
+			case 'R':
+				opts.rulesPath = optarg;
+				break;
+			case 'N':
+				if ((opts.spins = atoi(optarg)) < 0)
+					return -1;
+				break;
+			case 'O':
+				if (parseSize(optarg, &opts.ioBytes))
+					return -1;
+				break;
+			case 'A':
+				opts.autotune = optarg;
+				break;
+			case 'G':
+				opts.benchScaling = optarg;
+				break;
+			case 'w':
+				opts.benchWorkers = atoi(optarg);
+				if (opts.benchWorkers < 1 || opts.benchWorkers > MAX_WORKERS)
+					return -1;
+				break;
+			case 'v':
+				opts.benchCsv = optarg;
+				break;
+			case 'F':
+				opts.benchRoofline = optarg;
+				break;
+			case 'J':
+				opts.benchLatency = optarg;
+				break;
+			case 'r':
+				opts.realtime = 1;
+				break;
+			case 'y':
+				opts.realtime = 1;
+				opts.realtimePriority = atoi(optarg);
+				if (opts.realtimePriority < sched_get_priority_min(SCHED_FIFO)
+						|| opts.realtimePriority > sched_get_priority_max(SCHED_FIFO))
+					return -1;
+				break;
+			case 'P':
+				// Found and loaded before parsing by profileFind
+				break;
+			case 'L':
+				if ((opts.latencyMax = strtod(optarg, NULL)) <= 0)
+					return -1;
+				break;
+			default:
+				return -1;
+		}
+	}
+	// Every buffer must hold at least two of the longest lines
+	if (opts.queueBytes < 2 * recordSize(LINE_SIZE))
+		return -1;
+
+	// A growing input has no fixed content to cache, flushes unaligned lines and blocks the thread of every coroutine
+	// while it waits for appends, and only files can be rotated
+	if (opts.follow && (opts.cacheDir || opts.direct || opts.coroutines || opts.eventLoop))
+		return -1;
+	if ((opts.rotateBytes || opts.rotateLines || opts.compress || opts.direct) && !opts.outputPath)
+		return -1;
+
+	// Only closed rotated files are compressed, and cached results are served to stdout, not to output files
+	if (opts.compress && !opts.rotateBytes && !opts.rotateLines)
+		return -1;
+	if (opts.cacheDir && opts.outputPath)
+		return -1;
+
+	// Server pipelines write to their connections and keep nothing on disk
+	if ((opts.pipelineBudget || opts.globalBudget) && !opts.nServe)
+		return -1;
+	if (opts.nServe && (opts.follow || opts.cacheDir || opts.outputPath || opts.spillMax))
+		return -1;
+
+	// The span interface has no stages, caches or output files
+	if (opts.zeroCopy && (opts.lineCacheBytes || opts.cacheDir || opts.follow || opts.outputPath || opts.coroutines
+			|| opts.spillMax || opts.nServe))
+		return -1;
+
+	// The tee branch reads lines before the plus sign stage, where cached lines already had the rule applied
+	if (opts.teePath && (opts.lineCacheBytes || opts.cacheDir || opts.zeroCopy || opts.nServe))
+		return -1;
+
+	// Merged sources are read with stdio by input stages of their own, and have no single file to cache or follow
+	if (opts.nInputs && (opts.cacheDir || opts.follow || opts.eventLoop || opts.zeroCopy || opts.nServe))
+		return -1;
+
+	// Cached transforms would outlive a reload of the rules they were made with
+	if (opts.rulesPath && (opts.lineCacheBytes || opts.cacheDir || opts.zeroCopy || opts.nServe))
+		return -1;
+
+	// Real-time stages must not allocate, touch files other than stdin and stdout, or reload rules once they run
+	if (opts.realtime && (opts.lineCacheBytes || opts.cacheDir || opts.outputPath || opts.teePath || opts.nInputs
+			|| opts.rulesPath || opts.spillMax || opts.nServe || opts.zeroCopy))
+		return -1;
+
+	// Trials and benchmarks run single pipelines from their own input to stdout
+	if ((opts.autotune || opts.benchScaling || opts.benchLatency) && (opts.follow || opts.cacheDir || opts.outputPath
+			|| opts.zeroCopy || opts.nServe || opts.nInputs))
+		return -1;
+
+	// Queue slots hold one line for one consumer, without the raw line of a cache miss, and cannot spill, so the ring is
+	// used unless asked for explicitly
+	if (opts.mpmcQueues && (opts.teePath || opts.spillMax || opts.lineCacheBytes)) {
+		if (opts.mpmcQueues == 1)
+			return -1;
+		opts.mpmcQueues = 0;
+	}
+
+	// A round must admit at least one line of every pipeline
+	if (opts.drrQuantum && opts.drrQuantum < LINE_SIZE)
+		return -1;
+	return optind == argc ? 0 : -1;
+}
+
+/**
+ * @brief Runs the pipeline from stdin to stdout with the current options until its input has ended.
+ *
+ * @param name The name of the program, for error messages.
+ * @return 0 on success, or 1 if the pipeline could not be set up.
+ */
+int runPipeline(const char* name) {
+	// Init the pipeline from stdin to stdout
+	Pipeline* p = &mainPipeline;
+	if (pipelineInit(p, opts.queueBytes)) {
+		fprintf(stderr, "%s: cannot allocate %zu byte buffers\n", name, opts.queueBytes);
+		return 1;
+	}
+
+	// Let the buffer in front of the output thread spill to disk
+	if (opts.spillMax && bufferSpillInit(&p->buffers[NUM_BUFFS - 1], opts.spillDir, opts.spillMax)) {
+		fprintf(stderr, "%s: cannot create spill file in %s: %s\n", name, opts.spillDir, strerror(errno));
+		return 1;
+	}
+
+	// Watch the input for appends, flushing each output line as it is produced
+	if (opts.follow) {
+		if ((followFd = followInit()) < 0) {
+			fprintf(stderr, "%s: --follow requires stdin to be a regular file\n", name);
+			return 1;
+		}
+		setvbuf(stdout, NULL, _IOLBF, 0);
+	}
+
+	// Serve the output from the result cache if this input was seen before
+	if (opts.cacheDir && resultCacheLookup(&resultCache, opts.cacheDir, hashRules(p->args, NUM_THREADS)))
+		return 0;
+
+	// Write to output files instead of stdout
+	if (opts.outputPath)
+		outputFilesInit(&outputFiles, opts.outputPath);
+
+	// Merge several input files, each read by its own input stage
+	Source sources[MAX_SOURCES];
+	for (int i = 0; i < opts.nInputs; i++)
+		sources[i].path = opts.inputs[i];
+	if (opts.nInputs && pipelineMerge(p, sources, opts.nInputs, opts.mergeOrder, opts.queueBytes)) {
+		fprintf(stderr, "%s: out of memory\n", name);
+		return 1;
+	}
+
+	// Format the separated lines a second way in a tee branch
+	TeeOutput tee;
+	if (opts.teePath) {
+		if (teeInit(&tee, opts.teePath, opts.teeWidth)) {
+			fprintf(stderr, "%s: cannot create %s: %s\n", name, opts.teePath, strerror(errno));
+			return 1;
+		}
+		pipelineTee(p, &tee);
+	}
+
+	// Raise pipe capacities and size reads and writes to them, and to the tuned size otherwise
+	const int stdinPipe = pipeGrow(STDIN_FILENO), stdoutPipe = pipeGrow(STDOUT_FILENO);
+	if (opts.eventLoop)
+		ioBufferInit(&p->in, stdinPipe);
+	else if (stdinPipe)
+		setvbuf(stdin, NULL, _IOFBF, stdinPipe);
+	else if (opts.ioBytes)
+		setvbuf(stdin, NULL, _IOFBF, opts.ioBytes);
+	if (opts.eventLoop || (stdoutPipe && !opts.outputPath))
+		ioBufferInit(&p->out, stdoutPipe);
+	else if (opts.ioBytes && !opts.outputPath && !opts.follow)
+		setvbuf(stdout, NULL, _IOFBF, opts.ioBytes);
+
+	// Make stdin and stdout non-blocking for the event loop, restoring their flags at exit
+	int stdinFlags = fcntl(STDIN_FILENO, F_GETFL), stdoutFlags = fcntl(STDOUT_FILENO, F_GETFL);
+	if (opts.eventLoop) {
+		epollFd = epoll_create1(EPOLL_CLOEXEC);
+		fcntl(STDIN_FILENO, F_SETFL, stdinFlags | O_NONBLOCK);
+		fcntl(STDOUT_FILENO, F_SETFL, stdoutFlags | O_NONBLOCK);
+	}
+
+	// Load the rules, and reload them from another thread on SIGHUP or when the file changes
+	pthread_t watcher;
+	if (opts.rulesPath) {
+		if (!(rules = rulesLoad(opts.rulesPath)))
+			return 1;
+		sigset_t hup;
+		sigemptyset(&hup);
+		sigaddset(&hup, SIGHUP);
+		pthread_sigmask(SIG_BLOCK, &hup, NULL);
+		pthread_create(&watcher, NULL, rulesWatcher, p);
+	}
+
+	// Prefault and lock memory once everything the stages use is allocated
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if (opts.realtime)
+		realtimeInit(p, opts.eventLoop ? 0 : stdinPipe ? (size_t) stdinPipe : opts.ioBytes ? opts.ioBytes : BUFSIZ,
+				p->out.buff ? 0 : opts.ioBytes ? opts.ioBytes : BUFSIZ, &attr);
+
+	// Run stages as coroutines on this thread, or create and join threads
+	if (opts.coroutines) {
+		for (int i = 0; i < p->nStages; i++)
+			coroutineSpawn(processThread, &p->args[i], p);
+		runCoroutines();
+	} else {
+		// Lock mutex so that cancelPipeline sees every input thread once they all exist
+		pthread_t threads[MAX_STAGES];
+		pthread_mutex_lock(&p->readersMutex);
+		for (int i = 0; i < p->nStages; i++) {
+			pthread_create(&threads[i], &attr, processThread, &p->args[i]);
+			if (!p->args[i].readBuff)
+				p->readers[p->nReaders++] = threads[i];
+		}
+		pthread_mutex_unlock(&p->readersMutex);
+
+		// Join the other stages first, which end only after every input thread has passed on its last line or the
+		// pipeline was cancelled, then forget the input threads before joining them
+		for (int i = 0; i < p->nStages; i++)
+			if (p->args[i].readBuff)
+				pthread_join(threads[i], NULL);
+		pthread_mutex_lock(&p->readersMutex);
+		p->nReaders = 0;
+		pthread_mutex_unlock(&p->readersMutex);
+		for (int i = 0; i < p->nStages; i++)
+			if (!p->args[i].readBuff)
+				pthread_join(threads[i], NULL);
+	}
+	pthread_attr_destroy(&attr);
+
+	// Report the longest any stage held a line
+	if (opts.realtime) {
+		fprintf(stderr, "realtime: max stage stall");
+		for (int i = 0; i < NUM_THREADS; i++)
+			fprintf(stderr, "%s %s %.0f us", i ? "," : "", stageNames[i], p->args[i].stall * 1e6);
+		fprintf(stderr, "\n");
+	}
+
+	if (opts.eventLoop) {
+		fcntl(STDIN_FILENO, F_SETFL, stdinFlags);
+		fcntl(STDOUT_FILENO, F_SETFL, stdoutFlags);
+		close(epollFd);
+	}
+
+	// Cleanup buffers and exit
+	pipelineDestroy(p);
+	if (opts.lineCacheBytes)
+		lineCacheDestroy(&lineCache);
+	if (opts.outputPath)
+		outputFilesDestroy(&outputFiles);
+	if (opts.teePath)
+		teeDestroy(&tee);
+	if (opts.rulesPath) {
+		pthread_cancel(watcher);
+		pthread_join(watcher, NULL);
+		free(rules);
+	}
+	resultCacheFinish(&resultCache);
+	if (followFd >= 0)
+		close(followFd);
+	return 0;
+}
+
+/**
+ * @struct AutotuneTrial
+ * @brief A structure describing one trial of the autotuner, run in a child process.
+ *
+ * @var AutotuneTrial::seconds
+ * The time the pipeline took to process the input.
+ * @var AutotuneTrial::lines
+ * The number of lines the pipeline read.
+ * @var AutotuneTrial::queued
+ * The sum over the buffers of the largest number of lines each held at once.
+ * @var AutotuneTrial::status
+ * The exit status of the pipeline.
+ */
+typedef struct {
+	double seconds;
+	unsigned long lines;
+	long queued;
+	int status;
+} AutotuneTrial;
+
+/**
+ * @brief Runs the pipeline once in a child process with the given options, from the input file to /dev/null.
+ *
+ * @param trialOpts The options to run the pipeline with.
+ * @param result A pointer to the AutotuneTrial that will store the result of the trial.
+ * @return 0 on success, or -1 if the child could not be run or failed.
+ */
+int autotuneRun(const Options* trialOpts, AutotuneTrial* result) {
+	int report[2];
+	if (pipe(report))
+		return -1;
+	fflush(stdout);
+	const pid_t pid = fork();
+	if (pid < 0)
+		return -1;
+	if (!pid) {
+		// Process the input like a normal run and report back
+		const int in = open(trialOpts->autotune, O_RDONLY | O_CLOEXEC), out = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		if (in < 0 || out < 0 || dup2(in, STDIN_FILENO) < 0 || dup2(out, STDOUT_FILENO) < 0)
+			_exit(1);
+		opts = *trialOpts;
+		const double start = monotonicTime();
+		AutotuneTrial trial = {.status = runPipeline("autotune")};
+		fflush(stdout);
+		trial.seconds = monotonicTime() - start;
+		trial.lines = mainPipeline.lines;
+		for (int i = 0; i < NUM_BUFFS; i++)
+			trial.queued += mainPipeline.buffers[i].peakCount;
+		_exit(write(report[1], &trial, sizeof(trial)) == sizeof(trial) ? 0 : 1);
+	}
+	close(report[1]);
+	const ssize_t n = read(report[0], result, sizeof(*result));
+	close(report[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	return n == sizeof(*result) && !result->status && WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : -1;
+}
+
+/**
+ * @brief Finds the path of the profile, given with --profile or in the home directory.
+ *
+ * The command line is scanned before it is parsed, so the profile can be loaded first and the options on the command
+ * line override it.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv An array of pointers to the command-line argument strings.
+ * @param path A buffer of PATH_MAX characters that will store the path.
+ * @return path, or NULL if there is no home directory.
+ */
+const char* profileFind(int argc, char* argv[], char path[]) {
+	for (int i = 1; i < argc; i++)
+		if (!strncmp(argv[i], "--profile=", 10)) {
+			snprintf(path, PATH_MAX, "%s", argv[i] + 10);
+			return path;
+		}
+	const char* home = getenv("HOME");
+	if (!home)
+		return NULL;
+	snprintf(path, PATH_MAX, "%s/.line_processor_profile", home);
+	return path;
+}
+
+/**
+ * @brief Loads the settings of a profile written by the autotuner into the options.
+ *
+ * Every line of the profile that is not empty or a comment starting with # holds a setting as name=value, where name
+ * is one of queue-bytes, queue, spin and io-bytes, taking the same values as the options of the same names. Only the
+ * settings the profile holds are applied, so the others keep their defaults, e.g. the spin budget derived from the CPUs
+ * available. Unknown or invalid settings are reported and ignored. A missing profile is not an error. A queue=mpmc
+ * setting is dropped when options that need the ring are given, see parseOptions.
+ *
+ * @param path The path of the profile.
+ */
+void profileLoad(const char* path) {
+	FILE* file = fopen(path, "r");
+	if (!file)
+		return;
+	char text[LINE_SIZE];
+	for (int n = 1; fgets(text, sizeof(text), file); n++) {
+		char name[LINE_SIZE], value[LINE_SIZE];
+		if (text[strspn(text, " \t\n")] == '#' || text[strspn(text, " \t\n")] == '\0')
+			continue;
+		// Apply a setting only once its value is known to be valid
+		size_t size;
+		int ok = sscanf(text, " %999[^= ] = %999s", name, value) == 2;
+		if (ok && !strcmp(name, "queue-bytes")) {
+			if ((ok = !parseSize(value, &size) && size >= 2 * recordSize(LINE_SIZE)))
+				opts.queueBytes = size;
+		} else if (ok && !strcmp(name, "queue")) {
+			if ((ok = !strcmp(value, "mpmc") || !strcmp(value, "ring")))
+				opts.mpmcQueues = !strcmp(value, "mpmc") ? 2 : 0;
+		} else if (ok && !strcmp(name, "spin")) {
+			if ((ok = atoi(value) >= 0))
+				opts.spins = atoi(value);
+		} else if (ok && !strcmp(name, "io-bytes")) {
+			if ((ok = !parseSize(value, &size)))
+				opts.ioBytes = size;
+		} else
+			ok = 0;
+		if (!ok)
+			fprintf(stderr, "profile: %s:%d: ignoring invalid setting\n", path, n);
+	}
+	fclose(file);
+}
+
+/**
+ * @brief Picks the queue capacity, queue kind, spin budget and I/O batch size with the best throughput on this host.
+ *
+ * The autotune function runs the pipeline AUTOTUNE_RUNS times on the input for every combination of a grid of
+ * settings, keeping the fastest run of each, with the other options as given. The queueing latency of a combination is
+ * estimated by Little's law as the lines held in the buffers at their peaks over the rate lines are processed at.
+ * The fastest combination within the latency ceiling is written to the profile, which later runs load. The spin budget
+ * only applies to the queue, so it is left out of the profile when the ring wins, and runs keep the default derived
+ * from the CPUs available.
+ *
+ * @param profile The path of the profile to write.
+ * @return 0 on success, or 1 if no trial succeeded or the profile could not be written.
+ */
+int autotune(const char* profile) {
+	static const size_t queueGrid[] = {16 << 10, 64 << 10, 256 << 10, 1 << 20};
+	static const int spinGrid[] = {0, 64, 1024};
+	static const size_t ioGrid[] = {4 << 10, 64 << 10, 1 << 20};
+	struct stat st;
+	if (stat(opts.autotune, &st) || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "autotune: %s is not a regular file\n", opts.autotune);
+		return 1;
+	}
+
+	Options best = opts;
+	double bestRate = 0, bestLatency = 0, fallbackLatency = 0;
+	int within = 0;
+	printf("%-12s %-5s %5s %9s %10s %11s\n", "queue-bytes", "queue", "spin", "io-bytes", "MB/s", "latency ms");
+	for (size_t q = 0; q < sizeof(queueGrid) / sizeof(queueGrid[0]); q++)
+		for (int mpmc = 0; mpmc < 2; mpmc++)
+			for (size_t s = 0; s < (mpmc ? sizeof(spinGrid) / sizeof(spinGrid[0]) : 1); s++)
+				for (size_t io = 0; io < sizeof(ioGrid) / sizeof(ioGrid[0]); io++) {
+					// Queue slots cannot feed a tee branch or spill, and buffers must fit the memory limit
+					if ((mpmc && (opts.teePath || opts.spillMax))
+							|| (limits.memory && NUM_BUFFS * queueGrid[q] > limits.memory / MEMORY_SHARE))
+						continue;
+					Options trial = opts;
+					trial.queueBytes = queueGrid[q];
+					trial.mpmcQueues = mpmc;
+					trial.spins = mpmc ? spinGrid[s] : opts.spins;
+					trial.ioBytes = ioGrid[io];
+
+					// Keep the fastest of several runs
+					AutotuneTrial fastest = {0};
+					for (int run = 0; run < AUTOTUNE_RUNS; run++) {
+						AutotuneTrial result;
+						if (!autotuneRun(&trial, &result) && (!fastest.seconds || result.seconds < fastest.seconds))
+							fastest = result;
+					}
+					if (!fastest.seconds) {
+						fprintf(stderr, "autotune: trial failed\n");
+						continue;
+					}
+					const double rate = st.st_size / fastest.seconds;
+					const double latency = fastest.lines ? 1e3 * fastest.queued * fastest.seconds / fastest.lines : 0;
+					printf("%-12zu %-5s %5d %9zu %10.1f %11.3f\n", trial.queueBytes, mpmc ? "mpmc" : "ring",
+							mpmc ? trial.spins : 0, trial.ioBytes, rate / 1e6, latency);
+
+					// Prefer throughput within the latency ceiling, and the lowest latency if nothing is within
+					if (latency <= opts.latencyMax ? !within || rate > bestRate
+							: !within && (!bestRate || latency < fallbackLatency)) {
+						within = latency <= opts.latencyMax;
+						best = trial;
+						bestRate = rate;
+						bestLatency = fallbackLatency = latency;
+					}
+				}
+	if (!bestRate)
+		return 1;
+	if (!within)
+		fprintf(stderr, "autotune: no setting stays within %.3f ms, using the one with the lowest latency\n",
+				opts.latencyMax);
+
+	// Write the profile next to its final path and move it into place
+	char tmpPath[PATH_MAX];
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", profile);
+	FILE* file = fopen(tmpPath, "w");
+	if (!file) {
+		fprintf(stderr, "autotune: cannot create %s: %s\n", tmpPath, strerror(errno));
+		return 1;
+	}
+	fprintf(file, "# Written by --autotune from %s: %.1f MB/s, %.3f ms queueing latency\n", opts.autotune,
+			bestRate / 1e6, bestLatency);
+	fprintf(file, "queue-bytes=%zu\nqueue=%s\n", best.queueBytes, best.mpmcQueues ? "mpmc" : "ring");
+	if (best.mpmcQueues)
+		fprintf(file, "spin=%d\n", best.spins);
+	fprintf(file, "io-bytes=%zu\n", best.ioBytes);
+	if (fclose(file) || rename(tmpPath, profile)) {
+		fprintf(stderr, "autotune: cannot write %s: %s\n", profile, strerror(errno));
+		unlink(tmpPath);
+		return 1;
+	}
+	printf("best: queue-bytes=%zu queue=%s", best.queueBytes, best.mpmcQueues ? "mpmc" : "ring");
+	if (best.mpmcQueues)
+		printf(" spin=%d", best.spins);
+	printf(" io-bytes=%zu, written to %s\n", best.ioBytes, profile);
+	return 0;
+}
+
+/**
+ * @brief Starts a pipeline in a child process, from an input file to /dev/null.
+ *
+ * @param input The path of the input file.
+ * @return The process ID of the child, or -1 if it could not be started.
+ */
+pid_t scalingSpawn(const char* input) {
+	const pid_t pid = fork();
+	if (!pid) {
+		const int in = open(input, O_RDONLY | O_CLOEXEC), out = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		if (in < 0 || out < 0 || dup2(in, STDIN_FILENO) < 0 || dup2(out, STDOUT_FILENO) < 0)
+			_exit(1);
+		const int status = runPipeline("bench");
+		fflush(stdout);
+		_exit(status);
+	}
+	return pid;
+}
+
+/**
+ * @brief Runs one pipeline per input file in parallel, SCALING_RUNS times, and returns the shortest run.
+ *
+ * @param inputs The paths of the input files.
+ * @param n The number of input files, and so of pipelines.
+ * @return The time from starting the first pipeline until the last one exited in seconds, or -1 if one failed.
+ */
+double scalingRun(char* inputs[], int n) {
+	double best = -1;
+	for (int run = 0; run < SCALING_RUNS; run++) {
+		pid_t pids[MAX_WORKERS];
+		int failed = 0;
+		fflush(stdout);
+		const double start = monotonicTime();
+		for (int i = 0; i < n; i++)
+			failed |= (pids[i] = scalingSpawn(inputs[i])) < 0;
+		for (int i = 0; i < n; i++) {
+			int status;
+			if (pids[i] > 0 && (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)))
+				failed = 1;
+		}
+		const double elapsed = monotonicTime() - start;
+		if (failed)
+			return -1;
+		if (best < 0 || elapsed < best)
+			best = elapsed;
+	}
+	return best;
+}
+
+/**
+ * @brief Splits a file into line aligned parts of about equal size, written to temporary files.
+ *
+ * @param input The path of the file to split.
+ * @param n The number of parts.
+ * @param parts An array of n buffers of PATH_MAX characters that will store the paths of the parts.
+ * @return 0 on success, or -1 if the file could not be read or a part could not be written.
+ */
+int scalingSplit(const char* input, int n, char* parts[]) {
+	const int in = open(input, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (in < 0 || fstat(in, &st)) {
+		if (in >= 0)
+			close(in);
+		return -1;
+	}
+	char* data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in, 0) : NULL;
+	close(in);
+	if (st.st_size && data == MAP_FAILED)
+		return -1;
+
+	// End every part after the line separator following its share of the bytes
+	int failed = 0;
+	off_t start = 0;
+	for (int i = 0; i < n; i++) {
+		off_t end = i == n - 1 ? st.st_size : st.st_size / n * (i + 1);
+		if (end < start)
+			end = start;
+		const char* nl = end < st.st_size ? memchr(data + end, '\n', st.st_size - end) : NULL;
+		end = i == n - 1 ? st.st_size : nl ? nl - data + 1 : st.st_size;
+		snprintf(parts[i], PATH_MAX, "%s/line_processor.part.XXXXXX", opts.spillDir);
+		const int fd = mkstemp(parts[i]);
+		if (fd < 0 || write(fd, data + start, end - start) != end - start)
+			failed = 1;
+		if (fd >= 0)
+			close(fd);
+		start = end;
+	}
+	if (data)
+		munmap(data, st.st_size);
+	return failed ? -1 : 0;
+}
+
+/**
+ * @brief Measures how the throughput of the pipeline scales with the number of pipelines run in parallel.
+ *
+ * The benchScalingRun function runs 1, 2, 4, ... up to the given number of pipelines in parallel, each as a process
+ * of its own with the other options as given. For strong scaling, the input is split into one line aligned part per
+ * pipeline, so the same work is shared by more pipelines. For weak scaling, every pipeline processes the whole input,
+ * so the work grows with the pipelines. Every point is the shortest of SCALING_RUNS runs. Throughput, speedup and
+ * efficiency relative to a single pipeline are printed as a table and written to a CSV file.
+ *
+ * @param workers The largest number of pipelines to run in parallel.
+ * @return 0 on success, or 1 if the input could not be read or a pipeline failed.
+ */
+int benchScalingRun(int workers) {
+	struct stat st;
+	if (stat(opts.benchScaling, &st) || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "bench: %s is not a regular file\n", opts.benchScaling);
+		return 1;
+	}
+	FILE* csv = fopen(opts.benchCsv, "w");
+	if (!csv) {
+		fprintf(stderr, "bench: cannot create %s: %s\n", opts.benchCsv, strerror(errno));
+		return 1;
+	}
+	fprintf(csv, "mode,workers,bytes,seconds,mb_per_s,speedup,efficiency\n");
+	printf("%-7s %7s %14s %9s %9s %8s %10s\n", "mode", "workers", "bytes", "seconds", "MB/s", "speedup", "efficiency");
+
+	// Allocate one input path per pipeline
+	char (*names)[PATH_MAX] = malloc(workers * sizeof(*names));
+	char* paths[MAX_WORKERS];
+	if (!names) {
+		fprintf(stderr, "bench: cannot allocate input paths\n");
+		fclose(csv);
+		return 1;
+	}
+	for (int i = 0; i < workers; i++)
+		paths[i] = names[i];
+	int failed = 0;
+	for (int weak = 0; weak < 2 && !failed; weak++) {
+		double single = 0;
+		for (int n = 1;; n = n * 2 > workers && n < workers ? workers : n * 2) {
+			// Share the input between the pipelines, or give each all of it
+			if (weak)
+				for (int i = 0; i < n; i++)
+					snprintf(paths[i], PATH_MAX, "%s", opts.benchScaling);
+			else if (scalingSplit(opts.benchScaling, n, paths)) {
+				fprintf(stderr, "bench: cannot split %s into %s: %s\n", opts.benchScaling, opts.spillDir,
+						strerror(errno));
+				failed = 1;
+				break;
+			}
+			const double seconds = scalingRun(paths, n);
+			if (!weak)
+				for (int i = 0; i < n; i++)
+					unlink(paths[i]);
+			if (seconds <= 0) {
+				fprintf(stderr, "bench: a pipeline failed with %d workers\n", n);
+				failed = 1;
+				break;
+			}
+
+			// Compare to a single pipeline doing its share of the work
+			if (n == 1)
+				single = seconds;
+			const long long bytes = weak ? (long long) st.st_size * n : st.st_size;
+			const double speedup = weak ? n * single / seconds : single / seconds;
+			const double efficiency = speedup / n;
+			printf("%-7s %7d %14lld %9.3f %9.1f %8.2f %9.0f%%\n", weak ? "weak" : "strong", n, bytes, seconds,
+					bytes / seconds / 1e6, speedup, 100 * efficiency);
+			fprintf(csv, "%s,%d,%lld,%.6f,%.3f,%.4f,%.4f\n", weak ? "weak" : "strong", n, bytes, seconds,
+					bytes / seconds / 1e6, speedup, efficiency);
+			if (n == workers)
+				break;
+		}
+	}
+	free(names);
+	if (fclose(csv)) {
+		fprintf(stderr, "bench: cannot write %s: %s\n", opts.benchCsv, strerror(errno));
+		return 1;
+	}
+	if (!failed)
+		printf("wrote %s\n", opts.benchCsv);
+	return failed;
+}
+
+/**
+ * The kernels timed by the memory bandwidth benchmark, the first two of which measure the bandwidth limits.
+ */
+enum {ROOF_READ, ROOF_MEMCPY, ROOF_SPLIT, ROOF_SEPARATOR, ROOF_PLUS, ROOF_FORMAT, ROOF_KERNELS};
+
+const char* const roofNames[ROOF_KERNELS] = {"read", "memcpy", "reader line split", "separator replaceSubstring",
+		"plus replaceSubstring", "printOutput formatting"};
+
+/**
+ * @struct RooflineInput
+ * @brief A structure holding the input of the memory bandwidth benchmark in the forms each kernel takes it in.
+ *
+ * @var RooflineInput::data
+ * The input file as read.
+ * @var RooflineInput::size
+ * The number of bytes of input.
+ * @var RooflineInput::lines
+ * The lines of the input in the form the separator, plus and output stages receive them, each ending in a null byte.
+ * @var RooflineInput::starts
+ * The offset of every line in lines.
+ * @var RooflineInput::nLines
+ * The number of lines.
+ * @var RooflineInput::work
+ * Memory the kernels write to, as large as lines.
+ * @var RooflineInput::p
+ * The pipeline the formatting kernel outputs through, writing to /dev/null.
+ */
+typedef struct {
+	char* data;
+	size_t size;
+	char* lines[ROOF_KERNELS];
+	size_t* starts;
+	size_t nLines;
+	char* work;
+	Pipeline* p;
+} RooflineInput;
+
+volatile uint64_t roofSink;
+
+/**
+ * @brief Runs a kernel of the memory bandwidth benchmark once over the whole input.
+ *
+ * Every kernel but the line split works on the lines in the form its stage receives them. Restoring the lines a
+ * transform rewrote in place is not timed.
+ *
+ * @param in A pointer to the RooflineInput to run the kernel on.
+ * @param kernel The kernel to run.
+ * @return The time the kernel took in seconds.
+ */
+double rooflinePass(RooflineInput* in, int kernel) {
+	const ThreadArgs* args = &stageArgs[kernel == ROOF_SEPARATOR ? 1 : 2];
+	FILE* file = NULL;
+	if (kernel == ROOF_SPLIT && !(file = fmemopen(in->data, in->size, "r"))) {
+		fprintf(stderr, "bench: cannot open the input as a stream: %s\n", strerror(errno));
+		exit(1);
+	}
+	if (kernel == ROOF_SEPARATOR || kernel == ROOF_PLUS)
+		memcpy(in->work, in->lines[kernel], in->starts[in->nLines]);
+	in->p->pending[0] = '\0';
+
+	const double start = monotonicTime();
+	switch (kernel) {
+		case ROOF_READ: {
+			// Sum whole words so the loads are not optimized away
+			uint64_t sum = 0, word;
+			size_t i = 0;
+			for (; i + sizeof(word) <= in->size; i += sizeof(word)) {
+				memcpy(&word, in->data + i, sizeof(word));
+				sum += word;
+			}
+			for (; i < in->size; i++)
+				sum += (unsigned char) in->data[i];
+			roofSink = sum;
+			break;
+		}
+		case ROOF_MEMCPY:
+			memcpy(in->work, in->data, in->size);
+			break;
+		case ROOF_SPLIT: {
+			char line[LINE_SIZE];
+			while (!readLine(in->p, file, line))
+				roofSink += line[0];
+			break;
+		}
+		case ROOF_SEPARATOR:
+		case ROOF_PLUS:
+			for (size_t i = 0; i < in->nLines; i++)
+				replaceSubstring(in->work + in->starts[i], args->searchStr, args->replaceChar);
+			break;
+		case ROOF_FORMAT:
+			for (size_t i = 0; i < in->nLines; i++)
+				printOutput(in->p, in->lines[ROOF_FORMAT] + in->starts[i]);
+			pipelineFlush(in->p);
+			break;
+	}
+	const double elapsed = monotonicTime() - start;
+	if (file)
+		fclose(file);
+	return elapsed;
+}
+
+/**
+ * @brief Measures how close each kernel of the pipeline comes to the memory bandwidth of the machine.
+ *
+ * The benchRoofline function reads the input into memory and measures the bandwidth of reading it without writing,
+ * and of copying it with memcpy, which bound what any kernel can reach. It then times the line split of the input
+ * stage, replaceSubstring as called by the separator and plus stages, and the formatting of printOutput on the same
+ * data, each in the form its stage receives it. Every kernel is run until it has taken ROOFLINE_SECONDS and its
+ * fastest run is reported, in input bytes per second and as a percentage of both bandwidth limits. The kernel furthest
+ * from the memcpy bandwidth is named as the one to optimize next.
+ *
+ * For the limits to reflect memory rather than cache bandwidth, the input should be much larger than the last level
+ * cache.
+ *
+ * @return 0 on success, or 1 if the input could not be read.
+ */
+int benchRoofline(void) {
+	// Read the input into memory
+	struct stat st;
+	const int fd = open(opts.benchRoofline, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size) {
+		fprintf(stderr, "bench: %s is not a non-empty regular file\n", opts.benchRoofline);
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+	RooflineInput in = {.size = st.st_size};
+	if (!(in.data = malloc(in.size + 1))) {
+		fprintf(stderr, "bench: out of memory\n");
+		exit(1);
+	}
+	for (size_t done = 0; done < in.size;) {
+		const ssize_t n = read(fd, in.data + done, in.size - done);
+		if (n <= 0) {
+			fprintf(stderr, "bench: cannot read %s: %s\n", opts.benchRoofline, n ? strerror(errno) : "file shrank");
+			close(fd);
+			return 1;
+		}
+		done += n;
+	}
+	close(fd);
+	in.data[in.size] = '\0';
+
+	// Split the input into lines as the input stage does, each followed by a null byte
+	for (size_t i = 0; i < in.size; i += strcspn(in.data + i, "\n") + 1)
+		in.nLines++;
+	char* lines = malloc(in.size + in.nLines + 1);
+	if (!lines || !(in.starts = malloc((in.nLines + 1) * sizeof(size_t)))) {
+		fprintf(stderr, "bench: out of memory\n");
+		exit(1);
+	}
+	size_t len = 0, n = 0;
+	for (size_t i = 0, end; i < in.size; i = end) {
+		end = i + strcspn(in.data + i, "\n") + 1;
+		if (end > in.size)
+			end = in.size;
+		in.starts[n++] = len;
+		memcpy(lines + len, in.data + i, end - i);
+		len += end - i;
+		lines[len++] = '\0';
+	}
+	in.starts[n] = len;
+	if (!(in.work = malloc(len))) {
+		fprintf(stderr, "bench: out of memory\n");
+		exit(1);
+	}
+
+	// Give every transform and the output stage the lines as the stage before would pass them on
+	in.lines[ROOF_SEPARATOR] = lines;
+	for (int kernel = ROOF_PLUS; kernel <= ROOF_FORMAT; kernel++) {
+		if (!(in.lines[kernel] = malloc(len))) {
+			fprintf(stderr, "bench: out of memory\n");
+			exit(1);
+		}
+		memcpy(in.lines[kernel], in.lines[kernel - 1], len);
+		for (size_t i = 0; i < in.nLines; i++)
+			replaceSubstring(in.lines[kernel] + in.starts[i], stageArgs[kernel - ROOF_SEPARATOR].searchStr,
+					stageArgs[kernel - ROOF_SEPARATOR].replaceChar);
+	}
+
+	// Format output to /dev/null through the pipeline's own output buffer
+	Pipeline* p = in.p = malloc(sizeof(Pipeline));
+	if (!p || pipelineInit(p, opts.queueBytes)) {
+		fprintf(stderr, "bench: out of memory\n");
+		exit(1);
+	}
+	if ((p->outFd = open("/dev/null", O_WRONLY | O_CLOEXEC)) < 0) {
+		fprintf(stderr, "bench: cannot open /dev/null: %s\n", strerror(errno));
+		exit(1);
+	}
+	ioBufferInit(&p->out, 0);
+
+	// Keep the fastest run of every kernel
+	double rate[ROOF_KERNELS];
+	for (int kernel = 0; kernel < ROOF_KERNELS; kernel++) {
+		double best = 0;
+		for (double total = 0; total < ROOFLINE_SECONDS;) {
+			const double seconds = rooflinePass(&in, kernel);
+			total += seconds;
+			if (!best || seconds < best)
+				best = seconds;
+		}
+		rate[kernel] = in.size / (best > 0 ? best : 1e-9);
+	}
+
+	// Rank the kernels against both limits
+	printf("%-28s %10s %8s %8s\n", "kernel", "MB/s", "% read", "% memcpy");
+	int next = -1;
+	for (int kernel = 0; kernel < ROOF_KERNELS; kernel++) {
+		printf("%-28s %10.1f %7.0f%% %7.0f%%\n", roofNames[kernel], rate[kernel] / 1e6,
+				100 * rate[kernel] / rate[ROOF_READ], 100 * rate[kernel] / rate[ROOF_MEMCPY]);
+		if (kernel > ROOF_MEMCPY && (next < 0 || rate[kernel] < rate[next]))
+			next = kernel;
+	}
+	printf("next: %s, at %.0f%% of memcpy bandwidth\n", roofNames[next], 100 * rate[next] / rate[ROOF_MEMCPY]);
+
+	close(p->outFd);
+	pipelineDestroy(p);
+	free(p);
+	for (int kernel = ROOF_SEPARATOR; kernel <= ROOF_FORMAT; kernel++)
+		free(in.lines[kernel]);
+	free(in.starts);
+	free(in.work);
+	free(in.data);
+	return 0;
+}
+
+/**
+ * @struct LatencyLoad
+ * @brief A structure describing the input side of the open loop latency benchmark.
+ *
+ * @var LatencyLoad::fd
+ * The write end of the pipe to the pipeline's stdin.
+ * @var LatencyLoad::rate
+ * The number of lines sent per second.
+ * @var LatencyLoad::start
+ * The time the first line is due to be sent.
+ * @var LatencyLoad::lines
+ * The number of lines to send.
+ * @var LatencyLoad::sent
+ * The time each line was actually sent.
+ */
+typedef struct {
+	int fd;
+	double rate, start;
+	unsigned long lines;
+	double* sent;
+} LatencyLoad;
+
+/**
+ * @brief Sends numbered lines to the pipeline at a fixed rate, followed by the stop line.
+ *
+ * Line i is due at start + i / rate whether or not the pipeline has kept up. A line whose time has passed, because a
+ * write blocked on a full pipe, is sent at once, so the schedule never slips. Every line holds its number followed by
+ * filler up to PRINT_SIZE - 1 characters, so once its separator is replaced it forms exactly one output line.
+ *
+ * @param args A pointer to the LatencyLoad.
+ * @return NULL The function returns NULL as it is intended to be used with pthread_create.
+ */
+void* latencyWriter(void* args) {
+	LatencyLoad* load = args;
+	char line[PRINT_SIZE];
+	memset(line, 'l', PRINT_SIZE - 1);
+	line[PRINT_SIZE - 1] = '\n';
+	for (unsigned long i = 0; i < load->lines; i++) {
+		// Wait for the line's time on the schedule
+		const double due = load->start + i / load->rate;
+		const struct timespec ts = {(time_t) due, (long) ((due - (time_t) due) * 1e9)};
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+		const int len = snprintf(line, sizeof(line), "%020lu", i);
+		line[len] = 'l';
+		load->sent[i] = monotonicTime();
+		for (size_t done = 0; done < sizeof(line);) {
+			const ssize_t n = write(load->fd, line + done, sizeof(line) - done);
+			if (n < 0 && errno != EINTR) {
+				close(load->fd);
+				return NULL;
+			}
+			done += n > 0 ? n : 0;
+		}
+	}
+	if (write(load->fd, "STOP\n", 5) < 0)
+		fprintf(stderr, "bench: cannot write the stop line: %s\n", strerror(errno));
+	close(load->fd);
+	return NULL;
+}
+
+/**
+ * @brief Prints the percentiles of a set of latencies, sorting them.
+ *
+ * @param label The name of the set.
+ * @param latencies The latencies in seconds.
+ * @param n The number of latencies, at least 1.
+ */
+void latencyPrint(const char* label, double* latencies, size_t n) {
+	qsort(latencies, n, sizeof(double), compareDoubles);
+	printf("%-12s", label);
+	const double percentiles[] = {50, 90, 99, 99.9, 99.99};
+	for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+		printf(" %10.0f", latencies[(size_t) (n * percentiles[i] / 100)] * 1e6);
+	printf(" %10.0f\n", latencies[n - 1] * 1e6);
+}
+
+/**
+ * @brief Measures the end to end latency of lines arriving at a steady rate, without coordinated omission.
+ *
+ * The benchLatency function runs the pipeline with the other options as given in a child process reading a pipe and
+ * writing another. A writer thread sends numbered lines at the given rate, which does not depend on how fast the
+ * pipeline consumes them, and the output is read as it arrives. The latency of each line is measured from the time it
+ * was due on the schedule to the time its output line was read. This corrects for coordinated omission: when the
+ * pipeline stalls and the writer blocks, the lines that should have been sent meanwhile count the stall too, instead
+ * of being sent late and timed from then. The latency from the time each line was actually written, which hides those
+ * stalls, is printed as well for comparison, with the percentiles of both in microseconds.
+ *
+ * @param spec The rate in lines per second, optionally followed by a comma and the duration in seconds.
+ * @return 0 on success, or 1 if the spec is invalid or the pipeline failed.
+ */
+int benchLatency(const char* spec) {
+	char* end;
+	LatencyLoad load = {.rate = strtod(spec, &end)};
+	const double seconds = *end == ',' ? strtod(end + 1, &end) : LATENCY_SECONDS;
+	if (*end || !(load.rate > 0) || !(seconds > 0) || load.rate * seconds > 1e9) {
+		fprintf(stderr, "bench: invalid rate or duration: %s\n", spec);
+		return 1;
+	}
+	load.lines = load.rate * seconds > 1 ? load.rate * seconds : 1;
+	double* arrived = calloc(load.lines, sizeof(double));
+	if (!arrived || !(load.sent = malloc(load.lines * sizeof(double)))) {
+		fprintf(stderr, "bench: out of memory\n");
+		exit(1);
+	}
+
+	// Run the pipeline between two pipes
+	int in[2], out[2];
+	if (pipe2(in, O_CLOEXEC) || pipe2(out, O_CLOEXEC)) {
+		fprintf(stderr, "bench: cannot create pipes: %s\n", strerror(errno));
+		return 1;
+	}
+	fflush(stdout);
+	const pid_t pid = fork();
+	if (!pid) {
+		if (dup2(in[0], STDIN_FILENO) < 0 || dup2(out[1], STDOUT_FILENO) < 0)
+			_exit(1);
+		const int status = runPipeline("bench");
+		fflush(stdout);
+		_exit(status);
+	}
+	close(in[0]);
+	close(out[1]);
+	if (pid < 0) {
+		fprintf(stderr, "bench: cannot start the pipeline: %s\n", strerror(errno));
+		return 1;
+	}
+
+	// Send on schedule, giving the pipeline a moment to start
+	pthread_t writer;
+	load.fd = in[1];
+	load.start = monotonicTime() + LATENCY_WARMUP;
+	pthread_create(&writer, NULL, latencyWriter, &load);
+
+	// Time the arrival of every output line, checking they come back in order
+	char buff[1 << 16];
+	size_t len = 0, received = 0;
+	ssize_t n;
+	int failed = 0;
+	while ((n = read(out[0], buff + len, sizeof(buff) - len)) > 0 || (n < 0 && errno == EINTR)) {
+		const double now = monotonicTime();
+		len += n > 0 ? n : 0;
+		size_t used = 0;
+		for (; len - used >= PRINT_SIZE + 1; used += PRINT_SIZE + 1) {
+			const unsigned long seq = strtoul(buff + used, NULL, 10);
+			if (seq != received || seq >= load.lines)
+				failed = 1;
+			else
+				arrived[received++] = now;
+		}
+		memmove(buff, buff + used, len - used);
+		len -= used;
+	}
+	close(out[0]);
+	pthread_join(writer, NULL);
+	int status;
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) || received < load.lines)
+		failed = 1;
+	if (failed) {
+		fprintf(stderr, "bench: the pipeline failed or lost lines, %zu of %lu came back\n", received, load.lines);
+		free(arrived);
+		free(load.sent);
+		return 1;
+	}
+
+	// Time every line from when it was due and from when it was written
+	double* corrected = malloc(load.lines * sizeof(double));
+	if (!corrected) {
+		fprintf(stderr, "bench: out of memory\n");
+		exit(1);
+	}
+	double lag = 0;
+	for (unsigned long i = 0; i < load.lines; i++) {
+		const double due = load.start + i / load.rate;
+		corrected[i] = arrived[i] - due;
+		arrived[i] -= load.sent[i];
+		if (load.sent[i] - due > lag)
+			lag = load.sent[i] - due;
+	}
+	printf("%lu lines at %.0f lines/s, sent at most %.0f us behind schedule\n", load.lines, load.rate, lag * 1e6);
+	printf("%-12s %10s %10s %10s %10s %10s %10s\n", "latency (us)", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+	latencyPrint("corrected", corrected, load.lines);
+	latencyPrint("uncorrected", arrived, load.lines);
+	free(corrected);
+	free(arrived);
+	free(load.sent);
+	return 0;
+}
+
+/**
+ * @brief The main function of the multi-threaded text processing application.
+ *
+ * The main function initializes the shared buffers, creates four threads with their corresponding ThreadArgs
+ * structures, and starts the threads. It then waits for all threads to complete execution and cleans up resources
+ * by destroying the mutexes and condition variables associated with the buffers. The program reads input from stdin,
+ * processes it using the threads, and prints the formatted output to stdout. Optional features are enabled with
+ * command-line arguments, see printUsage.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv An array of pointers to the command-line argument strings.
+ * @return 0 The function returns 0 to indicate successful execution.
+ */
+#ifndef LINE_PROCESSOR_LIBRARY
+int main(int argc, char* argv[]) {
+	// Spin only when every stage can hold a CPU of its own, as spinning otherwise burns the CPU quota
+	limitsInit();
+	if (limits.cpus < NUM_THREADS)
+		opts.spins = 0;
+
+	// Load the settings tuned for this host, which the options override
+	char profile[PATH_MAX];
+	if (profileFind(argc, argv, profile))
+		profileLoad(profile);
+
+	// Parse options, then fit the buffers to the memory limit
+	if (parseOptions(argc, argv)) {
+		printUsage(argv[0]);
+		return 1;
+	}
+	limitsApply();
+
+	// Report a closed stdout as EPIPE, cancelling the pipeline, instead of dying on SIGPIPE
+	signal(SIGPIPE, SIG_IGN);
+
+	// Init line cache, shared by all pipelines
+	if (opts.lineCacheBytes && lineCacheInit(&lineCache, opts.lineCacheBytes)) {
+		fprintf(stderr, "%s: line cache budget of %zu bytes is too small\n", argv[0], opts.lineCacheBytes);
+		return 1;
+	}
+
+	// Serve a pipeline to every connection instead of processing stdin
+	if (opts.nServe)
+		return serverRun();
+
+	// Tune the settings for this host
+	if (opts.autotune) {
+		if (!profileFind(argc, argv, profile)) {
+			fprintf(stderr, "%s: --autotune needs --profile or a home directory\n", argv[0]);
+			return 1;
+		}
+		return autotune(profile);
+	}
+
+	// Measure how throughput scales with the pipelines run in parallel, by default one per available CPU
+	if (opts.benchScaling)
+		return benchScalingRun(opts.benchWorkers ? opts.benchWorkers : limits.cpus < MAX_WORKERS ? limits.cpus
+				: MAX_WORKERS);
+
+	// Measure the latency of lines arriving at a steady rate
+	if (opts.benchLatency)
+		return benchLatency(opts.benchLatency);
+
+	// Compare the kernels to the memory bandwidth
+	if (opts.benchRoofline)
+		return benchRoofline();
+
+	// Run the stream mix benchmark against a server
+	if (opts.benchStreams)
+		return benchStreams(opts.benchStreams);
+
+	// Transform stdin without the stages
+	if (opts.zeroCopy)
+		return zeroCopyRun();
+
+	// Transform stdin to stdout
+	return runPipeline(argv[0]);
+}
+#endif
@@ -0,0 +1,188 @@
+/**
+ * @file queue_stress.c
+ * @author Nils Streedain (https://github.com/nilsstreedain)
+ * @brief A check of the ring and the multi-producer multi-consumer queue behind the buffers under contention.
+ *
+ * The buffer internals are not part of the library interface, so this program includes main.c itself, compiled with
+ * LINE_PROCESSOR_LIBRARY to leave out its main function.
+ *
+ * Example usage:
+ * gcc --std=gnu99 -o queue_stress tests/queue_stress.c -lpthread -lm
+ * ./queue_stress 8
+ */
+#define LINE_PROCESSOR_LIBRARY
+#include "../main.c"
+
+#define STRESS_LINES 2000000
+#define MAX_STRESS_THREADS 64
+
+/**
+ * @struct StressThread
+ * @brief A structure describing a producer or consumer of the queue stress check.
+ *
+ * @var StressThread::buffer
+ * A pointer to the Buffer under stress.
+ * @var StressThread::id
+ * The index of the producer, which it stores in the upper half of the key of every line.
+ * @var StressThread::producers
+ * The number of producers, whose lines a consumer checks.
+ * @var StressThread::lines
+ * The number of lines a producer stores, or the number of lines a consumer retrieved.
+ * @var StressThread::sum
+ * The sum of the sequence numbers of the lines a consumer retrieved.
+ * @var StressThread::errors
+ * The number of lines a consumer retrieved out of order or with text not matching their key.
+ */
+typedef struct {
+	Buffer* buffer;
+	int id, producers;
+	unsigned long lines;
+	unsigned long long sum;
+	unsigned long errors;
+} StressThread;
+
+/**
+ * @brief Stores numbered lines in the buffer under stress.
+ *
+ * @param args A pointer to the StressThread of the producer.
+ * @return NULL
+ */
+void* stressProducer(void* args) {
+	StressThread* st = args;
+	Line line = {.text = ""};
+	for (unsigned long i = 0; i < st->lines; i++) {
+		line.key = (uint64_t) st->id << 32 | i;
+		snprintf(line.text, LINE_SIZE, "%d:%lu\n", st->id, i);
+		putBuff(st->buffer, &line);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Retrieves lines from the buffer under stress until the stop key, checking that the lines of every producer
+ * arrive intact and in order.
+ *
+ * @param args A pointer to the StressThread of the consumer.
+ * @return NULL
+ */
+void* stressConsumer(void* args) {
+	StressThread* st = args;
+	long long last[MAX_STRESS_THREADS];
+	for (int i = 0; i < st->producers; i++)
+		last[i] = -1;
+	Line line;
+	char expect[LINE_SIZE];
+	while (!getBuff(st->buffer, 0, &line) && line.key != UINT64_MAX) {
+		const int id = line.key >> 32;
+		const long long seq = line.key & UINT32_MAX;
+		snprintf(expect, sizeof(expect), "%d:%lld\n", id, seq);
+		if (id >= st->producers || seq <= last[id] || strcmp(line.text, expect))
+			st->errors++;
+		else
+			last[id] = seq;
+		st->lines++;
+		st->sum += seq;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Passes STRESS_LINES lines through one buffer from n producers to n consumers.
+ *
+ * @param mpmc 1 to back the buffer by the queue, or 0 to back it by the ring.
+ * @param n The number of producers and of consumers.
+ * @param rate A pointer that will store the number of lines passed per second.
+ * @return 0 if every line arrived intact and in order, or -1 otherwise.
+ */
+int stressRun(int mpmc, int n, double* rate) {
+	Buffer buffer;
+	if (bufferInit(&buffer, opts.queueBytes, mpmc)) {
+		fprintf(stderr, "stress: out of memory\n");
+		exit(1);
+	}
+	buffer.producers = n;
+
+	// Split the lines between the producers and run every thread
+	StressThread producers[MAX_STRESS_THREADS], consumers[MAX_STRESS_THREADS];
+	pthread_t threads[2 * MAX_STRESS_THREADS];
+	unsigned long long sum = 0;
+	const double start = monotonicTime();
+	for (int i = 0; i < n; i++) {
+		producers[i] = (StressThread) {&buffer, i, n, STRESS_LINES / n + (i < STRESS_LINES % n), 0, 0};
+		consumers[i] = (StressThread) {&buffer, i, n, 0, 0, 0};
+		sum += (unsigned long long) producers[i].lines * (producers[i].lines - 1) / 2;
+		pthread_create(&threads[i], NULL, stressProducer, &producers[i]);
+		pthread_create(&threads[n + i], NULL, stressConsumer, &consumers[i]);
+	}
+
+	// Stop every consumer once the producers are done
+	for (int i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	Line stop = {.key = UINT64_MAX};
+	for (int i = 0; i < n; i++)
+		putBuff(&buffer, &stop);
+	for (int i = 0; i < n; i++)
+		pthread_join(threads[n + i], NULL);
+	*rate = STRESS_LINES / (monotonicTime() - start);
+	bufferDestroy(&buffer);
+
+	// Every line must have arrived once
+	unsigned long lines = 0, errors = 0;
+	for (int i = 0; i < n; i++) {
+		lines += consumers[i].lines;
+		errors += consumers[i].errors;
+		sum -= consumers[i].sum;
+	}
+	if (lines != STRESS_LINES || errors || sum) {
+		fprintf(stderr, "stress: %s queue with %d threads: %lu of %d lines, %lu out of order or corrupted\n",
+				mpmc ? "mpmc" : "ring", n, lines, STRESS_LINES, errors);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Checks the ring and the multi-producer multi-consumer queue under contention and compares their throughput.
+ *
+ * The queueStress function passes STRESS_LINES numbered lines through a buffer of each kind from as many producers as
+ * consumers, doubling their number from one up to the given maximum, and prints the lines passed per second. Every
+ * consumer checks that the lines of each producer reach it intact and in order, and every line must arrive once.
+ *
+ * @param threads The largest number of producers and of consumers.
+ * @return 0 if every run passed its checks, or 1 otherwise.
+ */
+int queueStress(int threads) {
+	int failed = 0;
+	printf("%-8s %16s %16s\n", "threads", "ring lines/s", "mpmc lines/s");
+	for (int n = 1;; n = n * 2 > threads && n < threads ? threads : n * 2) {
+		double ring, mpmc;
+		failed |= stressRun(0, n, &ring);
+		failed |= stressRun(1, n, &mpmc);
+		printf("%-8d %16.0f %16.0f\n", n, ring, mpmc);
+		if (n == threads)
+			break;
+	}
+	return failed ? 1 : 0;
+}
+
+/**
+ * @brief The main function of the queue stress check.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv An array of pointers to the command-line argument strings, of which the optional first is the largest
+ * number of producers and of consumers (default 4, at most MAX_STRESS_THREADS).
+ * @return 0 if every run passed its checks, or 1 otherwise.
+ */
+int main(int argc, char* argv[]) {
+	const int threads = argc > 1 ? atoi(argv[1]) : 4;
+	if (threads < 1 || threads > MAX_STRESS_THREADS) {
+		fprintf(stderr, "usage: %s [THREADS], with 1 to %d threads\n", argv[0], MAX_STRESS_THREADS);
+		return 1;
+	}
+
+	// Spin only when every thread can hold a CPU of its own, as the pipeline does
+	limitsInit();
+	if (limits.cpus < 2 * threads)
+		opts.spins = 0;
+	return queueStress(threads);
+}
@@ -0,0 +1,91 @@
+#!/bin/sh
+# Builds the line processor and its checks into a temporary directory and runs them from the repository root.
+# Exits with status 1 if any check fails.
+cd "$(dirname "$0")/.." || exit 1
+build=$(mktemp -d) || exit 1
+trap 'rm -rf "$build"' EXIT
+failed=0
+
+check() {
+	name=$1
+	shift
+	if "$@"; then
+		echo "ok   $name"
+	else
+		echo "FAIL $name"
+		failed=1
+	fi
+}
+
+cc="gcc --std=gnu99 -O2"
+$cc -o "$build/line_processor" main.c -lpthread -lm || exit 1
+$cc -o "$build/queue_stress" tests/queue_stress.c -lpthread -lm || exit 1
+$cc -DLINE_PROCESSOR_LIBRARY -o "$build/span_fuzz" tests/span_fuzz.c main.c -lpthread -lm || exit 1
+
+# The expected output of every example input
+for i in 1 2 3; do
+	check "input$i" sh -c "'$build/line_processor' < input$i.txt | cmp -s - output$i.txt"
+done
+
+# Both queues under contention
+check "queue stress" "$build/queue_stress" 4
+
+# The span interface against the pipeline on random input
+check "span fuzz" "$build/span_fuzz" "$build/line_processor" 300
+
+# A larger input for the tools that time the pipeline, the first example's lines repeated
+grep -v '^STOP$' input1.txt > "$build/lines.txt"
+for i in $(seq 400); do cat "$build/lines.txt"; done > "$build/input.txt"
+lp="$build/line_processor"
+
+# The zero-copy mode starts at the current offset of a file on stdin like the pipeline, inside the first line or past
+# the first page
+offset() {
+	(head -c "$1" > /dev/null; "$lp" --zero-copy) < "$build/input.txt" > "$build/zero.txt" || return 1
+	(head -c "$1" > /dev/null; "$lp") < "$build/input.txt" | cmp -s - "$build/zero.txt"
+}
+check "zero-copy offset 80" offset 80
+check "zero-copy offset 5000" offset 5000
+
+# The autotuner writes every setting of the queue kind it picked to the profile, the spin budget only for the mpmc
+# queue, and a run loading it still produces the same output
+autotune() {
+	"$lp" --autotune="$build/input.txt" --profile="$build/profile" > /dev/null < /dev/null || return 1
+	[ "$(grep -c -E '^(queue-bytes|queue|io-bytes)=' "$build/profile")" = 3 ] || return 1
+	[ "$(grep -c '^spin=' "$build/profile")" = "$(grep -c '^queue=mpmc$' "$build/profile")" ] || return 1
+	"$lp" --profile="$build/none" < "$build/input.txt" > "$build/default.txt"
+	"$lp" --profile="$build/profile" < "$build/input.txt" | cmp -s - "$build/default.txt"
+}
+check "autotune" autotune
+
+# The scaling benchmark reports strong and weak scaling for every worker count
+scaling() {
+	"$lp" --bench-scaling="$build/input.txt" --bench-workers=3 --spill-dir="$build" --bench-csv="$build/scaling.csv" \
+			> /dev/null < /dev/null || return 1
+	rows=$(cut -d, -f1,2 "$build/scaling.csv" | tr '\n' ' ')
+	[ "$rows" = "mode,workers strong,1 strong,2 strong,3 weak,1 weak,2 weak,3 " ]
+}
+check "bench scaling" scaling
+
+# The roofline benchmark measures both limits and every kernel, and names a stage kernel to optimize next
+roofline() {
+	"$lp" --bench-roofline="$build/input.txt" > "$build/roofline.txt" < /dev/null || return 1
+	for kernel in "read" "memcpy" "reader line split" "separator replaceSubstring" "plus replaceSubstring" \
+			"printOutput formatting"; do
+		grep -q "^$kernel  *[0-9.]*[1-9][0-9.]* " "$build/roofline.txt" || return 1
+	done
+	grep -q "^next: .*\(split\|replaceSubstring\|formatting\), at" "$build/roofline.txt"
+}
+check "bench roofline" roofline
+
+# The latency benchmark times every line it sends, and latency from the due time is never below that from the write
+latency() {
+	"$lp" --bench-latency=1000,1 > "$build/latency.txt" < /dev/null || return 1
+	grep -q "^1000 lines at 1000 lines/s" "$build/latency.txt" || return 1
+	awk '$1 == "corrected" { for (i = 2; i <= 7; i++) c[i] = $i; n++ }
+			$1 == "uncorrected" { for (i = 2; i <= 7; i++) if ($i > c[i]) exit 1; n++ }
+			END { exit n != 2 }' "$build/latency.txt"
+}
+check "bench latency" latency
+
+exit $failed
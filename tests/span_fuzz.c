@@ -0,0 +1,256 @@
+/**
+ * @file span_fuzz.c
+ * @author Nils Streedain (https://github.com/nilsstreedain)
+ * @brief A differential fuzz of the zero-copy span interface against the four stage pipeline.
+ *
+ * For every seed, a random input of plain, "+" heavy, overlong, empty and stop-like lines is run through the line
+ * processor program and through the span interface, which must produce the same output byte for byte. The input is
+ * submitted as spans of random sizes into a staging area of a few lines, and output is released late and in random
+ * amounts, checking that released output was not overwritten and that every span is acknowledged exactly once.
+ *
+ * Example usage:
+ * gcc --std=gnu99 -DLINE_PROCESSOR_LIBRARY -o span_fuzz tests/span_fuzz.c main.c -lpthread -lm
+ * ./span_fuzz ./line_processor 300
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "../line_processor.h"
+
+#define FUZZ_INPUT_SIZE (1 << 16)
+#define FUZZ_OUTPUT_SIZE (1 << 17)
+#define FUZZ_MAX_SPANS FUZZ_INPUT_SIZE
+#define FUZZ_LINE_BYTES 81
+
+/**
+ * @struct FuzzRun
+ * @brief A structure holding the state of one run of the span interface.
+ *
+ * @var FuzzRun::sp
+ * The span pipeline under test.
+ * @var FuzzRun::rng
+ * The state of the random number generator deciding when output is released.
+ * @var FuzzRun::pending
+ * The output spans handed to the output callback and not yet released, oldest first.
+ * @var FuzzRun::pendingLen
+ * The number of bytes of every pending output span.
+ * @var FuzzRun::nPending
+ * The number of pending output spans.
+ * @var FuzzRun::output
+ * The output released so far, copied at release so output overwritten before its release is caught.
+ * @var FuzzRun::outputLen
+ * The number of bytes of output.
+ * @var FuzzRun::acks
+ * The number of times each input span was acknowledged.
+ * @var FuzzRun::spans
+ * The input spans, kept alive until the run ends.
+ */
+typedef struct {
+	SpanPipeline* sp;
+	uint64_t rng;
+	const char* pending[FUZZ_OUTPUT_SIZE / FUZZ_LINE_BYTES];
+	size_t pendingLen[FUZZ_OUTPUT_SIZE / FUZZ_LINE_BYTES];
+	size_t nPending;
+	char output[FUZZ_OUTPUT_SIZE];
+	size_t outputLen;
+	int acks[FUZZ_MAX_SPANS];
+	SpanInput spans[FUZZ_MAX_SPANS];
+} FuzzRun;
+
+/**
+ * @brief Returns the next number of a xorshift generator, so every seed reproduces the same run.
+ *
+ * @param state A pointer to the generator state, which must not be 0.
+ * @return A pseudo random 64-bit number.
+ */
+uint64_t fuzzRandom(uint64_t* state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+/**
+ * @brief Releases the oldest pending output, one whole span or its first line, copying it out first.
+ *
+ * @param run A pointer to the FuzzRun.
+ */
+void fuzzRelease(FuzzRun* run) {
+	const size_t len = fuzzRandom(&run->rng) % 2 ? run->pendingLen[0] : FUZZ_LINE_BYTES;
+	memcpy(run->output + run->outputLen, run->pending[0], len);
+	run->outputLen += len;
+	if (len < run->pendingLen[0]) {
+		run->pending[0] += len;
+		run->pendingLen[0] -= len;
+	} else {
+		run->nPending--;
+		memmove(run->pending, run->pending + 1, run->nPending * sizeof(run->pending[0]));
+		memmove(run->pendingLen, run->pendingLen + 1, run->nPending * sizeof(run->pendingLen[0]));
+	}
+	spanPipelineRelease(run->sp, len);
+}
+
+/**
+ * @brief Receives output of the span pipeline, releasing it right away or leaving it pending.
+ */
+void fuzzOutput(void* ctx, const char* data, size_t len) {
+	FuzzRun* run = ctx;
+	run->pending[run->nPending] = data;
+	run->pendingLen[run->nPending++] = len;
+	if (fuzzRandom(&run->rng) % 4 == 0)
+		fuzzRelease(run);
+}
+
+/**
+ * @brief Counts the acknowledgements of each input span.
+ */
+void fuzzAck(void* ctx, SpanInput* input) {
+	FuzzRun* run = ctx;
+	run->acks[input - run->spans]++;
+}
+
+/**
+ * @brief Generates a random input of lines of the kinds the transforms and the stop line treat specially.
+ *
+ * @param rng A pointer to the generator state.
+ * @param input The buffer that will store the input, of FUZZ_INPUT_SIZE bytes.
+ * @return The number of bytes of input.
+ */
+size_t fuzzInput(uint64_t* rng, char* input) {
+	static const char* const stops[] = {"STOP\n", "STOP", "STOP!\n", "ISTOP\n", "stop\n", "STO\n", "STOP+\n"};
+	static const char plain[] = "ab +";
+	size_t len = 0;
+	const int lines = fuzzRandom(rng) % 60;
+	for (int i = 0; i < lines; i++) {
+		const int kind = fuzzRandom(rng) % 10;
+		if (kind == 0) {
+			// A line that is, or almost is, the stop line
+			const char* stop = stops[fuzzRandom(rng) % (sizeof(stops) / sizeof(stops[0]))];
+			if (len + strlen(stop) > FUZZ_INPUT_SIZE)
+				break;
+			memcpy(input + len, stop, strlen(stop));
+			len += strlen(stop);
+			continue;
+		}
+
+		// An empty, short or overlong line, mostly plain or mostly plus signs
+		size_t n = kind == 1 ? 0 : kind == 2 ? 990 + fuzzRandom(rng) % 30 : fuzzRandom(rng) % 200;
+		if (len + n + 1 > FUZZ_INPUT_SIZE)
+			break;
+		for (size_t j = 0; j < n; j++)
+			input[len++] = kind == 3 ? "+x"[fuzzRandom(rng) % 8 == 0] : plain[fuzzRandom(rng) % 4];
+		if (i < lines - 1 || fuzzRandom(rng) % 2)
+			input[len++] = '\n';
+	}
+	return len;
+}
+
+/**
+ * @brief Runs the line processor program on an input.
+ *
+ * @param program The path of the line processor program.
+ * @param input The input.
+ * @param len The number of bytes of input.
+ * @param output The buffer that will store the output, of FUZZ_OUTPUT_SIZE bytes.
+ * @return The number of bytes of output, or -1 if the program could not be run.
+ */
+long fuzzPipeline(const char* program, const char* input, size_t len, char* output) {
+	char path[] = "/tmp/span_fuzz.XXXXXX";
+	const int fd = mkstemp(path);
+	if (fd < 0)
+		return -1;
+	const int written = write(fd, input, len) == (ssize_t) len;
+	close(fd);
+
+	char command[2 * PATH_MAX + 8];
+	snprintf(command, sizeof(command), "'%s' < '%s'", program, path);
+	FILE* pipe = written ? popen(command, "r") : NULL;
+	long n = -1;
+	if (pipe) {
+		n = fread(output, 1, FUZZ_OUTPUT_SIZE, pipe);
+		if (pclose(pipe))
+			n = -1;
+	}
+	unlink(path);
+	return n;
+}
+
+/**
+ * @brief Runs one seed through the program and the span interface and compares the outputs.
+ *
+ * @param program The path of the line processor program.
+ * @param seed The seed of the run.
+ * @return 0 if the outputs match and every span was acknowledged once, or -1 otherwise.
+ */
+int fuzzSeed(const char* program, uint64_t seed) {
+	static char input[FUZZ_INPUT_SIZE], expected[FUZZ_OUTPUT_SIZE];
+	static FuzzRun run;
+	uint64_t rng = seed * 0x9E3779B97F4A7C15ULL | 1;
+	const size_t len = fuzzInput(&rng, input);
+	const long expectedLen = fuzzPipeline(program, input, len, expected);
+	if (expectedLen < 0) {
+		fprintf(stderr, "seed %llu: cannot run %s\n", (unsigned long long) seed, program);
+		return -1;
+	}
+
+	// Submit the input in random spans to a staging area of a few lines
+	memset(&run, 0, sizeof(run));
+	run.rng = rng;
+	const size_t staging = (2 + fuzzRandom(&rng) % 6) * FUZZ_LINE_BYTES + fuzzRandom(&rng) % FUZZ_LINE_BYTES;
+	if (!(run.sp = spanPipelineCreate(staging, fuzzOutput, fuzzAck, &run))) {
+		fprintf(stderr, "seed %llu: cannot create the span pipeline\n", (unsigned long long) seed);
+		return -1;
+	}
+	size_t nSpans = 0;
+	for (size_t done = 0; done < len; nSpans++) {
+		size_t n = 1 + fuzzRandom(&rng) % (fuzzRandom(&rng) % 2 ? 8 : 2048);
+		n = n < len - done ? n : len - done;
+		run.spans[nSpans].data = input + done;
+		run.spans[nSpans].len = n;
+		spanPipelineSubmit(run.sp, &run.spans[nSpans]);
+		done += n;
+		while (run.nPending && fuzzRandom(&rng) % 3 == 0)
+			fuzzRelease(&run);
+	}
+
+	// Drain the output once the input has ended
+	spanPipelineFinish(run.sp);
+	while (run.nPending)
+		fuzzRelease(&run);
+	const int done = spanPipelineDone(run.sp);
+	spanPipelineDestroy(run.sp);
+
+	// Compare the outputs and the acknowledgements
+	int failed = !done || run.outputLen != (size_t) expectedLen || memcmp(run.output, expected, expectedLen);
+	for (size_t i = 0; i < nSpans; i++)
+		failed |= run.acks[i] != 1;
+	if (failed)
+		fprintf(stderr, "seed %llu: %zu input bytes in %zu spans, staging %zu: span output of %zu bytes%s does not "
+				"match %ld bytes of the pipeline\n", (unsigned long long) seed, len, nSpans, staging, run.outputLen,
+				done ? "" : " (not done)", expectedLen);
+	return failed ? -1 : 0;
+}
+
+/**
+ * @brief The main function of the span fuzz.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv An array of pointers to the command-line argument strings: the path of the line processor program,
+ * and optionally the number of seeds (default 300).
+ * @return 0 if every seed passed, or 1 otherwise.
+ */
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s LINE_PROCESSOR [SEEDS]\n", argv[0]);
+		return 1;
+	}
+	const int seeds = argc > 2 ? atoi(argv[2]) : 300;
+	int failed = 0;
+	for (int seed = 1; seed <= seeds; seed++)
+		failed |= fuzzSeed(argv[1], seed);
+	printf("span fuzz: %d seeds, %s\n", seeds, failed ? "failed" : "passed");
+	return failed ? 1 : 0;
+}